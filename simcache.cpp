@@ -8,234 +8,3655 @@ simcache.cpp
 #include <string>
 #include <vector>
 #include <fstream>
-#include <iomanip>
-#include <regex>
 #include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <algorithm>
+#include <new>
+#include <atomic>
+#include <thread>
+#include <sstream>
+#include <mutex>
+#include <deque>
+#include <functional>
+#include <array>
+#include <cmath>
+#include <numeric>
+
+// Native code generation for --core jit needs x86-64 and mmap
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__)) && !defined(E20_NO_JIT)
+#define E20_JIT 1
+#include <sys/mman.h>
+#endif
+
+// Files such as memory-access traces are mapped rather than read where mmap is available
+#if (defined(__unix__) || defined(__APPLE__)) && !defined(E20_NO_MMAP)
+#define E20_MMAP 1
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// Vectorized tag lookup for 8- and 16-way sets; AVX2 is only used if the CPU has it
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && !defined(E20_NO_SIMD)
+#define E20_X86_SIMD 1
+#include <immintrin.h>
+#endif
 
 using namespace std;
 
 size_t const static MEM_SIZE = 1 << 13;
 size_t const static NUM_REGS = 8;
 
+// The two kinds of memory access
+enum class AccessOp : uint8_t { LW, SW };
+
+// The outcome of one cache access. Stores are always logged as SW.
+enum class AccessResult : uint8_t { HIT, MISS, SW };
+
+// Log text for an access result
+const char* result_name(AccessResult result) {
+    static const char* const names[] = {"HIT", "MISS", "SW"};
+    return names[static_cast<int>(result)];
+}
+
+/*
+    Formats log output into a large reusable buffer and writes it out in
+    big chunks, instead of going through iostream formatting and flushing
+    after every line.
+*/
+class LogWriter {
+public:
+    static const size_t BUFFER_SIZE = 1 << 16;
+
+    explicit LogWriter(FILE* out) : out(out), buffer(BUFFER_SIZE), used(0) {}
+
+    ~LogWriter() { flush(); }
+
+    LogWriter(const LogWriter&) = delete;
+    LogWriter& operator=(const LogWriter&) = delete;
+
+    void put(char c) {
+        if (used == BUFFER_SIZE) drain();
+        buffer[used++] = c;
+    }
+
+    void text(const char* s, size_t n) {
+        if (used + n > BUFFER_SIZE) drain();
+        if (n > BUFFER_SIZE) {
+            fwrite(s, 1, n, out);
+            return;
+        }
+        copy(s, s + n, &buffer[used]);
+        used += n;
+    }
+
+    void text(const char* s) { text(s, strlen(s)); }
+    void text(const string& s) { text(s.data(), s.size()); }
+
+    // Appends n right-aligned in a field of at least width characters
+    void number(long long n, int width = 0) {
+        char digits[24];
+        int len = 0;
+        unsigned long long mag = n < 0 ? 0ULL - (unsigned long long)n : (unsigned long long)n;
+        do {
+            digits[len++] = '0' + mag % 10;
+            mag /= 10;
+        } while (mag != 0);
+        if (n < 0) digits[len++] = '-';
+        for (int pad = len; pad < width; pad++) put(' ');
+        while (len > 0) put(digits[--len]);
+    }
+
+    // Writes out everything buffered so far
+    void flush() {
+        drain();
+        fflush(out);
+    }
+
+private:
+    void drain() {
+        if (used > 0) fwrite(buffer.data(), 1, used, out);
+        used = 0;
+    }
+
+    FILE* out;
+    vector<char> buffer;
+    size_t used;
+};
+
 /*
     Prints out the correctly-formatted configuration of a cache.
 
+    @param log Where to print it
+
     @param cache_name The name of the cache. "L1" or "L2"
 
     @param size The total size of the cache, measured in memory cells.
         Excludes metadata
 
-    @param assoc The associativity of the cache. One of [1,2,4,8,16]
+    @param assoc The associativity of the cache. One of [1,2,4,8,16]
+
+    @param blocksize The blocksize of the cache. One of [1,2,4,8,16,32,64]
+
+    @param num_rows The number of rows in the given cache.
+*/
+void print_cache_config(LogWriter& log, const string& cache_name, int size, int assoc, int blocksize, int num_rows) {
+    log.text("Cache ");
+    log.text(cache_name);
+    log.text(" has size ");
+    log.number(size);
+    log.text(", associativity ");
+    log.number(assoc);
+    log.text(", blocksize ");
+    log.number(blocksize);
+    log.text(", rows ");
+    log.number(num_rows);
+    log.put('\n');
+}
+
+/*
+    Running totals for one cache, kept on every access whether or not
+    accesses are logged
+*/
+struct CacheStats {
+    uint64_t results[3] = {0, 0, 0}; // indexed by AccessResult
+
+    uint64_t count(AccessResult result) const { return results[static_cast<int>(result)]; }
+    uint64_t accesses() const { return results[0] + results[1] + results[2]; }
+    // Lines written into the cache: every LW miss, and every SW, since stores allocate
+    uint64_t fills() const { return count(AccessResult::MISS) + count(AccessResult::SW); }
+    uint64_t loads() const { return count(AccessResult::HIT) + count(AccessResult::MISS); }
+
+    // The accesses counted since these counters read start
+    CacheStats since(const CacheStats& start) const {
+        CacheStats delta;
+        for (int i = 0; i < 3; i++) delta.results[i] = results[i] - start.results[i];
+        return delta;
+    }
+
+    // Percentage of LW accesses that missed; SW is never a hit or a miss
+    double missRate() const {
+        return loads() == 0 ? 0.0 : 100.0 * count(AccessResult::MISS) / loads();
+    }
+};
+
+/*
+    Prints out the counters of a cache, as one line.
+
+    @param log Where to print it
+
+    @param cache_name The name of the cache. "L1" or "L2"
+
+    @param stats The cache's counters. The miss rate is over LW accesses
+        only, as SW is never a hit or a miss
+*/
+void print_cache_stats(LogWriter& log, const string& cache_name, const CacheStats& stats) {
+    uint64_t hits = stats.count(AccessResult::HIT);
+    uint64_t misses = stats.count(AccessResult::MISS);
+    char rate[32];
+    snprintf(rate, sizeof(rate), "%.2f%%", stats.missRate());
+
+    log.text("Cache ");
+    log.text(cache_name);
+    log.text(" stats: accesses ");
+    log.number(stats.accesses());
+    log.text(", LW hits ");
+    log.number(hits);
+    log.text(", LW misses ");
+    log.number(misses);
+    log.text(", SW ");
+    log.number(stats.count(AccessResult::SW));
+    log.text(", fills ");
+    log.number(stats.fills());
+    log.text(", miss rate ");
+    log.text(rate);
+    log.put('\n');
+}
+
+/*
+    Prints out a correctly-formatted log entry.
+
+    @param log Where to print it
+
+    @param cache_name The name of the cache where the event
+        occurred. "L1" or "L2"
+
+    @param status The kind of cache event. "SW", "HIT", or
+        "MISS"
+
+    @param pc The program counter of the memory
+        access instruction
+
+    @param addr The memory address being accessed.
+
+    @param row The cache row or set number where the data
+        is stored.
+*/
+void print_log_entry(LogWriter& log, const string& cache_name, const char* status, int pc, int addr, int row) {
+    // cache_name + " " + status, left-aligned in 8 columns
+    size_t status_len = strlen(status);
+    log.text(cache_name);
+    log.put(' ');
+    log.text(status, status_len);
+    for (size_t col = cache_name.size() + 1 + status_len; col < 8; col++) log.put(' ');
+    log.text(" pc:");
+    log.number(pc, 5);
+    log.text("\taddr:");
+    log.number(addr, 5);
+    log.text("\trow:");
+    log.number(row, 4);
+    log.put('\n');
+}
+
+/*
+    A bounded queue from one producer thread to one consumer thread,
+    without locks. Either side waits, spinning and then yielding, while
+    the ring is full or empty.
+*/
+template <class T>
+class SpscRing {
+public:
+    static const size_t CAPACITY = 1 << 14; // items; a power of two
+
+    SpscRing() : ring(CAPACITY), head(0), tail(0), closed(false), cached_tail(0), cached_head(0) {}
+
+    SpscRing(const SpscRing&) = delete;
+    SpscRing& operator=(const SpscRing&) = delete;
+
+    // Queues one item, waiting for the consumer if the ring is full
+    void push(const T& item) {
+        size_t h = head.load(memory_order_relaxed);
+        if (h - cached_tail == CAPACITY) {
+            while (h - (cached_tail = tail.load(memory_order_acquire)) == CAPACITY)
+                this_thread::yield();
+        }
+        ring[h & (CAPACITY - 1)] = item;
+        head.store(h + 1, memory_order_release);
+    }
+
+    // Tells the consumer that nothing more will be pushed
+    void close() { closed.store(true, memory_order_release); }
+
+    /*
+        Takes up to max items, waiting until there is at least one.
+
+        @return The number of items taken, or 0 once the ring is closed
+            and everything pushed has been taken
+    */
+    size_t pop(T* out, size_t max) {
+        size_t t = tail.load(memory_order_relaxed);
+        for (int idle = 0; cached_head == t; idle++) {
+            // Check closed before re-reading head, so nothing pushed before close() is missed
+            bool was_closed = closed.load(memory_order_acquire);
+            cached_head = head.load(memory_order_acquire);
+            if (cached_head != t) break;
+            if (was_closed) return 0;
+            if (idle > 64) this_thread::yield();
+        }
+        size_t n = min(max, cached_head - t);
+        for (size_t i = 0; i < n; i++) out[i] = ring[(t + i) & (CAPACITY - 1)];
+        tail.store(t + n, memory_order_release);
+        return n;
+    }
+
+private:
+    vector<T> ring;
+    // head is only written by the producer and tail only by the consumer;
+    // keep them on separate cache lines
+    alignas(64) atomic<size_t> head;
+    alignas(64) atomic<size_t> tail;
+    atomic<bool> closed;
+    alignas(64) size_t cached_tail; // producer's last view of tail
+    alignas(64) size_t cached_head; // consumer's last view of head
+};
+
+/*
+    One logged cache access, as passed from the simulation to an AsyncLog
+*/
+struct LogRecord {
+    const string* cache_name;
+    const char* status;
+    int pc;
+    int addr;
+    int row;
+};
+
+/*
+    Hands log entries to a writer thread through an SpscRing, so that the
+    simulation never waits on output unless the ring is full. The writer
+    thread formats the entries into a LogWriter.
+
+    The LogWriter must not be used by anyone else until finish() returns,
+    and the cache names in pushed records must stay alive until then.
+*/
+class AsyncLog {
+public:
+    explicit AsyncLog(LogWriter& out) : out(out), writer(&AsyncLog::run, this) {}
+
+    ~AsyncLog() { finish(); }
+
+    AsyncLog(const AsyncLog&) = delete;
+    AsyncLog& operator=(const AsyncLog&) = delete;
+
+    // Queues one entry. Only one thread may push
+    void push(const LogRecord& rec) { queue.push(rec); }
+
+    // Waits until every queued entry has been written, then stops the writer thread
+    void finish() {
+        if (!writer.joinable())
+            return;
+        queue.close();
+        writer.join();
+        out.flush();
+    }
+
+private:
+    void run() {
+        LogRecord batch[256];
+        size_t n;
+        while ((n = queue.pop(batch, 256)) > 0) {
+            for (size_t i = 0; i < n; i++)
+                print_log_entry(out, *batch[i].cache_name, batch[i].status, batch[i].pc, batch[i].addr, batch[i].row);
+        }
+    }
+
+    LogWriter& out;
+    SpscRing<LogRecord> queue;
+    thread writer;
+};
+
+/*
+    Memory-access traces, as written by --trace-out and read by --replay.
+
+    A trace is an 8-byte header followed by one little-endian 32-bit record
+    per access: the pc in the high 16 bits, then one bit for the kind of
+    access (1 for SW), then the 13-bit address.
+*/
+const char TRACE_MAGIC[8] = {'E', '2', '0', 'T', 'R', 'A', 'C', '1'};
+
+inline uint32_t trace_record(AccessOp op, int addr, uint16_t pc) {
+    return (uint32_t)pc << 16 | (uint32_t)op << 13 | (addr & 8191);
+}
+
+inline AccessOp trace_op(uint32_t rec) { return static_cast<AccessOp>((rec >> 13) & 1); }
+inline int trace_addr(uint32_t rec) { return rec & 8191; }
+inline uint16_t trace_pc(uint32_t rec) { return rec >> 16; }
+
+inline uint32_t load_le32(const unsigned char* p) {
+    return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+// Reads an unsigned little-endian value of the given number of bytes, and advances p past it
+inline uint64_t take_le(const unsigned char*& p, int bytes) {
+    uint64_t value = 0;
+    for (int b = 0; b < bytes; b++) value |= (uint64_t)*p++ << (8 * b);
+    return value;
+}
+
+// Appends value to out as a little-endian value of the given number of bytes
+inline void put_le(vector<unsigned char>& out, uint64_t value, int bytes) {
+    for (int b = 0; b < bytes; b++) out.push_back((unsigned char)(value >> (8 * b)));
+}
+
+/*
+    Collects access records. With a file, they are appended to it as a
+    trace in chunks; with a queue, they are passed on to another thread;
+    with neither, all of them are kept in memory.
+*/
+class TraceWriter {
+public:
+    static const size_t CHUNK = 1 << 14; // records
+
+    explicit TraceWriter(FILE* file = nullptr) : file(file), queue(nullptr) {
+        if (file != nullptr) fwrite(TRACE_MAGIC, 1, sizeof(TRACE_MAGIC), file);
+    }
+
+    explicit TraceWriter(SpscRing<uint32_t>& queue) : file(nullptr), queue(&queue) {}
+
+    ~TraceWriter() { drain(); }
+
+    TraceWriter(const TraceWriter&) = delete;
+    TraceWriter& operator=(const TraceWriter&) = delete;
+
+    void record(AccessOp op, int addr, uint16_t pc) {
+        if (queue != nullptr) {
+            queue->push(trace_record(op, addr, pc));
+            return;
+        }
+        records.push_back(trace_record(op, addr, pc));
+        if (file != nullptr && records.size() == CHUNK) drain();
+    }
+
+    // Everything recorded, if there is no file
+    const vector<uint32_t>& captured() const { return records; }
+
+private:
+    void drain() {
+        if (file == nullptr || records.empty()) return;
+        vector<unsigned char> bytes(records.size() * 4);
+        for (size_t i = 0; i < records.size(); i++) {
+            for (int b = 0; b < 4; b++) bytes[4 * i + b] = records[i] >> (8 * b);
+        }
+        fwrite(bytes.data(), 1, bytes.size(), file);
+        fflush(file);
+        records.clear();
+    }
+
+    FILE* file;
+    SpscRing<uint32_t>* queue;
+    vector<uint32_t> records;
+};
+
+/*
+    A read-only view of a whole file: mapped into memory where mmap is
+    available, and otherwise read into a buffer.
+*/
+class MappedFile {
+public:
+    MappedFile() : bytes(nullptr), length(0), mapped(false) {}
+
+    ~MappedFile() { close(); }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    // Returns false if the file can't be opened or read
+    bool open(const char* path) {
+        close();
+#ifdef E20_MMAP
+        int fd = ::open(path, O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            ::close(fd);
+            return false;
+        }
+        length = st.st_size;
+        if (length > 0) {
+            void* p = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                bytes = static_cast<const char*>(p);
+                mapped = true;
+                madvise(p, length, MADV_SEQUENTIAL);
+            }
+        }
+        ::close(fd);
+        if (mapped || length == 0) return true;
+#endif
+        ifstream f(path, ios::binary);
+        if (!f.is_open()) return false;
+        copy_of_file.assign(istreambuf_iterator<char>(f), istreambuf_iterator<char>());
+        bytes = copy_of_file.data();
+        length = copy_of_file.size();
+        return true;
+    }
+
+    const char* data() const { return bytes; }
+    size_t size() const { return length; }
+
+private:
+    void close() {
+#ifdef E20_MMAP
+        if (mapped) munmap(const_cast<char*>(bytes), length);
+#endif
+        mapped = false;
+        bytes = nullptr;
+        length = 0;
+        copy_of_file.clear();
+    }
+
+    const char* bytes;
+    size_t length;
+    bool mapped;
+    vector<char> copy_of_file;
+};
+
+// Whether file holds a well-formed trace
+bool is_trace(const MappedFile& file) {
+    return file.size() >= sizeof(TRACE_MAGIC) && (file.size() - sizeof(TRACE_MAGIC)) % 4 == 0 &&
+        equal(TRACE_MAGIC, TRACE_MAGIC + sizeof(TRACE_MAGIC), file.data());
+}
+
+/*
+    Parses one line of machine code, "ram[N] = 16'bB...;" followed by
+    anything but a carriage return, without the newline. The instruction
+    is read from the longest prefix of its digits that is binary.
+
+    @return false if the line isn't in that form
+*/
+bool parse_machine_code_line(const char* p, const char* end, size_t& addr, unsigned& instr) {
+    const char* const head = "ram[";
+    for (const char* c = head; *c != '\0'; c++, p++) {
+        if (p == end || *p != *c) return false;
+    }
+    if (p == end || *p < '0' || *p > '9') return false;
+    for (addr = 0; p != end && *p >= '0' && *p <= '9'; p++)
+        addr = min<size_t>(addr * 10 + (*p - '0'), (size_t)1 << 32);
+
+    const char* const middle = "] = 16'b";
+    for (const char* c = middle; *c != '\0'; c++, p++) {
+        if (p == end || *p != *c) return false;
+    }
+    if (p == end || (*p != '0' && *p != '1')) return false;
+    for (instr = 0; p != end && (*p == '0' || *p == '1'); p++) instr = instr << 1 | (*p - '0');
+    while (p != end && *p >= '0' && *p <= '9') p++;
+
+    if (p == end || *p != ';') return false;
+    return memchr(p, '\r', end - p) == nullptr;
+}
+
+/*
+    Loads a program, one word per line as produced by the assembler,
+    starting at address 0. Stops at the first line that can't be loaded.
+
+    @param words Set to the number of words loaded
+
+    @param error Set to what is wrong with the program, if anything
+
+    @return false if the program can't be loaded
+*/
+bool load_machine_code(const MappedFile& file, uint16_t mem[], size_t& words, string& error) {
+    const char* p = file.data();
+    const char* end = p + file.size();
+    size_t expectedaddr = 0;
+    while (p != end) {
+        const char* eol = static_cast<const char*>(memchr(p, '\n', end - p));
+        if (eol == nullptr) eol = end;
+        size_t addr;
+        unsigned instr;
+        if (!parse_machine_code_line(p, eol, addr, instr)) {
+            error = "Can't parse line: " + string(p, eol);
+            return false;
+        }
+        if (addr != expectedaddr) {
+            error = "Memory addresses encountered out of sequence: " + to_string(addr);
+            return false;
+        }
+        if (addr >= MEM_SIZE) {
+            error = "Program too big for memory";
+            return false;
+        }
+        expectedaddr++;
+        mem[addr] = instr;
+        p = eol == end ? end : eol + 1;
+    }
+    words = expectedaddr;
+    return true;
+}
+
+/*
+    Binary program images, as written by --write-image: an 8-byte magic
+    number, the number of words as a little-endian 32-bit value, then the
+    words themselves, little-endian, starting at address 0.
+*/
+const char IMAGE_MAGIC[8] = {'E', '2', '0', 'I', 'M', 'A', 'G', '1'};
+const size_t IMAGE_HEADER_SIZE = sizeof(IMAGE_MAGIC) + 4;
+
+bool is_program_image(const MappedFile& file) {
+    return file.size() >= sizeof(IMAGE_MAGIC) && equal(IMAGE_MAGIC, IMAGE_MAGIC + sizeof(IMAGE_MAGIC), file.data());
+}
+
+/*
+    Loads a program image into mem, as load_machine_code does for text.
+*/
+bool load_program_image(const MappedFile& file, uint16_t mem[], size_t& words, string& error) {
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(file.data());
+    if (file.size() < IMAGE_HEADER_SIZE) {
+        error = "Truncated program image";
+        return false;
+    }
+    uint32_t count = load_le32(bytes + sizeof(IMAGE_MAGIC));
+    if (count > MEM_SIZE) {
+        error = "Program too big for memory";
+        return false;
+    }
+    if (file.size() != IMAGE_HEADER_SIZE + 2 * (size_t)count) {
+        error = "Truncated program image";
+        return false;
+    }
+    const unsigned char* image = bytes + IMAGE_HEADER_SIZE;
+    for (uint32_t addr = 0; addr < count; addr++) mem[addr] = image[2 * addr] | image[2 * addr + 1] << 8;
+    words = count;
+    return true;
+}
+
+// Loads a program that is either an image or machine code text
+bool load_program(const MappedFile& file, uint16_t mem[], size_t& words, string& error) {
+    return is_program_image(file) ? load_program_image(file, mem, words, error) :
+                                    load_machine_code(file, mem, words, error);
+}
+
+/*
+    Writes the first count words of mem as a program image.
+
+    @return false if the file can't be written
+*/
+bool write_program_image(const char* path, const uint16_t mem[], size_t count) {
+    FILE* out = fopen(path, "wb");
+    if (out == nullptr) return false;
+    vector<unsigned char> bytes(IMAGE_HEADER_SIZE + 2 * count);
+    copy(IMAGE_MAGIC, IMAGE_MAGIC + sizeof(IMAGE_MAGIC), bytes.begin());
+    for (int b = 0; b < 4; b++) bytes[sizeof(IMAGE_MAGIC) + b] = (uint32_t)count >> (8 * b);
+    for (size_t addr = 0; addr < count; addr++) {
+        bytes[IMAGE_HEADER_SIZE + 2 * addr] = mem[addr] & 0xFF;
+        bytes[IMAGE_HEADER_SIZE + 2 * addr + 1] = mem[addr] >> 8;
+    }
+    bool ok = fwrite(bytes.data(), 1, bytes.size(), out) == bytes.size();
+    return fclose(out) == 0 && ok;
+}
+
+
+/*
+    Tag search within one set: returns the way holding tag, or -1. A set
+    holds each valid tag at most once.
+*/
+typedef int (*TagSearch)(const uint16_t* set, int assoc, uint16_t tag);
+
+int find_tag_scalar(const uint16_t* set, int assoc, uint16_t tag) {
+    for (int way = 0; way < assoc; way++) {
+        if (set[way] == tag) return way;
+    }
+    return -1;
+}
+
+#ifdef E20_X86_SIMD
+// Compares 8 ways per instruction; assoc must be a multiple of 8
+int find_tag_sse2(const uint16_t* set, int assoc, uint16_t tag) {
+    __m128i query = _mm_set1_epi16(tag);
+    unsigned mask = 0; // two bits per matching way
+    for (int way = 0; way < assoc; way += 8) {
+        __m128i ways = _mm_loadu_si128(reinterpret_cast<const __m128i*>(set + way));
+        mask |= (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi16(ways, query)) << (2 * way);
+    }
+    return mask == 0 ? -1 : __builtin_ctz(mask) / 2;
+}
+
+// Compares all ways of a 16-way set at once
+__attribute__((target("avx2")))
+int find_tag_avx2(const uint16_t* set, int /*assoc*/, uint16_t tag) {
+    __m256i ways = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(set));
+    unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi16(ways, _mm256_set1_epi16(tag)));
+    return mask == 0 ? -1 : __builtin_ctz(mask) / 2;
+}
+#endif
+
+// Picks the fastest tag search for an associativity on this CPU
+TagSearch select_tag_search(int assoc) {
+#ifdef E20_X86_SIMD
+    if (assoc == 16 && __builtin_cpu_supports("avx2")) return find_tag_avx2;
+    if (assoc % 8 == 0) return find_tag_sse2;
+#endif
+    return find_tag_scalar;
+}
+
+
+/*
+    A fixed-size heap array whose storage starts on a host cache line
+    boundary, so that small sets never straddle two lines.
+*/
+template <typename T>
+class AlignedArray {
+public:
+    static const size_t ALIGNMENT = 64;
+
+    AlignedArray() : data(nullptr), count(0) {}
+
+    AlignedArray(size_t n, T fill) : data(allocate(n)), count(n) {
+        for (size_t i = 0; i < n; i++) data[i] = fill;
+    }
+
+    AlignedArray(const AlignedArray& other) : data(allocate(other.count)), count(other.count) {
+        copy(other.data, other.data + count, data);
+    }
+
+    AlignedArray(AlignedArray&& other) noexcept : data(other.data), count(other.count) {
+        other.data = nullptr;
+        other.count = 0;
+    }
+
+    AlignedArray& operator=(AlignedArray other) noexcept {
+        swap(data, other.data);
+        swap(count, other.count);
+        return *this;
+    }
+
+    ~AlignedArray() {
+        if (data != nullptr) ::operator delete(data, align_val_t(ALIGNMENT));
+    }
+
+    T& operator[](size_t i) { return data[i]; }
+    const T& operator[](size_t i) const { return data[i]; }
+    T* get() { return data; }
+    const T* get() const { return data; }
+    size_t size() const { return count; }
+
+private:
+    static T* allocate(size_t n) {
+        if (n == 0) return nullptr;
+        return static_cast<T*>(::operator new(n * sizeof(T), align_val_t(ALIGNMENT)));
+    }
+
+    T* data;
+    size_t count;
+};
+
+
+class Cache {
+public:
+    /*
+        Tags are block_id / num_rows, so they are below MEM_SIZE and fit in
+        16 bits. Empty ways hold INVALID_TAG, which no access can match.
+
+        LRU state is a permutation of the way numbers per set, 4 bits per way
+        and packed in one word, so a hit or a fill updates it in constant
+        time without moving any tags. This limits associativity to 16.
+    */
+    static const uint16_t INVALID_TAG = 0xFFFF;
+    static const int MAX_ASSOC = 16;
+
+    /*
+        @param log Where to print the configuration and every access, or
+            nullptr for no output
+    */
+    Cache(const string& c_name, int c_size, int c_assoc, int c_block_size, LogWriter* log) {
+        name = c_name;
+        is_present = c_name != "dummy";
+        this->log = log;
+
+        if (c_name != "dummy") {
+            size = c_size;
+            num_rows = c_size / (c_assoc * c_block_size);
+            if (log != nullptr) print_cache_config(*log, c_name, c_size, c_assoc, c_block_size, num_rows);
+            block_size = c_block_size;
+            assoc = c_assoc;
+            // All sets back to back; set r occupies ways [r * assoc, (r + 1) * assoc)
+            tags = AlignedArray<uint16_t>((size_t)num_rows * assoc, INVALID_TAG);
+            order = AlignedArray<uint64_t>(num_rows, IDENTITY_ORDER);
+            find_tag = select_tag_search(assoc);
+
+            row_shift = 0;
+            while ((1 << row_shift) < num_rows) row_shift++;
+            row_mask = num_rows - 1;
+            engine = select_engine(assoc, block_size, (1 << row_shift) == num_rows);
+        } else {
+            engine = &Cache::absentAccess;
+        }
+    }
+
+    /*
+        Inserts new_tag as the most recent way of a set, replacing the least
+        recent one.
+
+        A store allocates even if its tag is already present. The old copy
+        then can never hit again, since lookups would always find the newer
+        one first, but it keeps its way until it ages out. It is therefore
+        kept as an empty way that holds its place in the recency order.
+
+        @param existing The way that already holds new_tag, or -1
+    */
+    void writeCache(int row_idx, uint16_t new_tag, int existing) {
+        uint16_t* set = &tags[(size_t)row_idx * assoc];
+        if (existing >= 0) set[existing] = INVALID_TAG;
+        int victim = (order[row_idx] >> (4 * (assoc - 1))) & 15;
+        set[victim] = new_tag;
+        order[row_idx] = moveToFront(order[row_idx], assoc - 1);
+    }
+
+    AccessResult handleLW(int row_idx, uint16_t tag_query) {
+        int target = findWay(row_idx, tag_query);
+        if (target < 0) {
+            writeCache(row_idx, tag_query, -1);
+            return AccessResult::MISS;
+        }
+        order[row_idx] = moveToFront(order[row_idx], recencyPosition(order[row_idx], target));
+        return AccessResult::HIT;
+    }
+
+    const string& getName() const { return name; }
+
+    // Whether this is a real cache, rather than the "dummy" standing in for a missing L2
+    bool present() const { return is_present; }
+
+    // Sends this cache's access log through sink instead of printing it directly
+    void logTo(AsyncLog* sink) { async_log = sink; }
+
+    // Prints this cache's accesses to writer from now on
+    void logTo(LogWriter* writer) { log = writer; }
+
+    // Records every access that reaches this cache into trace
+    void traceTo(TraceWriter* trace) { this->trace = trace; }
+
+    // Stops logging accesses; they are still counted
+    void stopLogging() {
+        log = nullptr;
+        async_log = nullptr;
+    }
+
+    const CacheStats& stats() const { return counters; }
+
+    // Puts the counters back to values read earlier, forgetting accesses since
+    void restoreStats(const CacheStats& saved) { counters = saved; }
+
+    // Counts accesses that were simulated elsewhere, on copies of this cache
+    void addStats(const CacheStats& more) {
+        for (int i = 0; i < 3; i++) counters.results[i] += more.results[i];
+    }
+
+    // The row, or set, that addr maps to
+    int rowOf(int addr) const { return addr / block_size % num_rows; }
+
+    int rows() const { return num_rows; }
+
+    // The stretch of memory that maps onto every row once; addresses that far apart share a row
+    int span() const { return num_rows * block_size; }
+
+    /*
+        Moves every line the cache holds by offset words, wrapping around
+        memory, as if all accesses so far had been offset words further on.
+        Only tag equality matters to LRU, so accesses moved the same way
+        then hit and miss exactly as the original ones did.
+
+        @param offset A multiple of span(), or of MEM_SIZE if span() doesn't
+            divide MEM_SIZE
+    */
+    void translate(uint64_t offset) {
+        offset %= MEM_SIZE;
+        if (!is_present || offset == 0) return;
+        uint16_t tag_count = MEM_SIZE / span();
+        uint16_t shift = offset / span();
+        for (size_t way = 0; way < (size_t)num_rows * assoc; way++)
+            if (tags[way] != INVALID_TAG) tags[way] = (tags[way] + shift) % tag_count;
+    }
+
+    /*
+        Whether this cache holds the same lines, in the same recency order,
+        as other, which has the same configuration. Which way a line sits
+        in makes no difference to later accesses.
+    */
+    bool sameContents(const Cache& other) const {
+        if (!is_present) return true;
+        for (int row = 0; row < num_rows; row++) {
+            const uint16_t* set = &tags[(size_t)row * assoc];
+            const uint16_t* other_set = &other.tags[(size_t)row * assoc];
+            for (int position = 0; position < assoc; position++) {
+                int shift = 4 * position;
+                if (set[(order[row] >> shift) & 15] != other_set[(other.order[row] >> shift) & 15]) return false;
+            }
+        }
+        return true;
+    }
+
+    /*
+        Appends this cache's configuration, contents, recency order and
+        counters to out, as part of a checkpoint. Must be a present cache.
+    */
+    void saveState(vector<unsigned char>& out) const {
+        put_le(out, size, 4);
+        put_le(out, assoc, 4);
+        put_le(out, block_size, 4);
+        for (size_t way = 0; way < (size_t)num_rows * assoc; way++) put_le(out, tags[way], 2);
+        for (int row = 0; row < num_rows; row++) put_le(out, order[row], 8);
+        for (int i = 0; i < 3; i++) put_le(out, counters.results[i], 8);
+    }
+
+    // The number of bytes saveState writes for a cache with this configuration
+    static size_t stateSize(int c_size, int c_assoc, int c_block_size) {
+        size_t rows = c_size / (c_assoc * c_block_size);
+        return 3 * 4 + rows * c_assoc * 2 + rows * 8 + 3 * 8;
+    }
+
+    /*
+        Checks that a state, saved by saveState from a cache with this
+        configuration, is one loadState can take: every recency order is a
+        permutation of the set's ways, with the unused nibbles left as in
+        IDENTITY_ORDER, and every tag is INVALID_TAG or one an address in
+        memory could have.
+
+        @param p The saved state, at least stateSize bytes long
+    */
+    static bool validState(const unsigned char* p, int c_size, int c_assoc, int c_block_size) {
+        size_t rows = c_size / (c_assoc * c_block_size);
+        uint16_t max_tag = (MEM_SIZE - 1) / c_block_size / rows;
+        p += 3 * 4;
+        for (size_t way = 0; way < rows * c_assoc; way++) {
+            uint16_t tag = take_le(p, 2);
+            if (tag != INVALID_TAG && tag > max_tag) return false;
+        }
+        for (size_t row = 0; row < rows; row++) {
+            uint64_t row_order = take_le(p, 8);
+            unsigned seen = 0;
+            for (int pos = 0; pos < MAX_ASSOC; pos++) {
+                int way = (row_order >> (4 * pos)) & 15;
+                if (pos < c_assoc ? way >= c_assoc || (seen >> way & 1) : way != pos) return false;
+                seen |= 1u << way;
+            }
+        }
+        return true;
+    }
+
+    /*
+        Takes the contents, recency order and counters saved by saveState
+        from a cache with the same configuration as this one, and advances
+        p past them.
+    */
+    void loadState(const unsigned char*& p) {
+        p += 3 * 4;
+        for (size_t way = 0; way < (size_t)num_rows * assoc; way++) tags[way] = take_le(p, 2);
+        for (int row = 0; row < num_rows; row++) order[row] = take_le(p, 8);
+        for (int i = 0; i < 3; i++) counters.results[i] = take_le(p, 8);
+    }
+
+    /*
+        Simulates one access and logs it.
+
+        @return HIT or MISS for a load, SW for a store
+    */
+    AccessResult access(AccessOp op, int addr, uint16_t pc) {
+        if (trace != nullptr) trace->record(op, addr, pc);
+
+        int row_idx;
+        AccessResult status = (this->*engine)(op, addr, row_idx);
+        counters.results[static_cast<int>(status)]++;
+
+        if (async_log != nullptr)
+            async_log->push(LogRecord{&name, result_name(status), pc, addr, row_idx});
+        else if (log != nullptr)
+            print_log_entry(*log, name, result_name(status), pc, addr, row_idx);
+        return status;
+    }
+
+private:
+    /*
+        Updates the cache for one access and reports the set it mapped to.
+        Every engine behaves the same; they differ only in what is known
+        at compile time.
+    */
+    typedef AccessResult (Cache::*Engine)(AccessOp op, int addr, int& row_idx);
+
+    // The dummy cache holds nothing, so every access misses
+    AccessResult absentAccess(AccessOp, int, int& row_idx) {
+        row_idx = 0;
+        return AccessResult::MISS;
+    }
+
+    // Works for any configuration, with all parameters read at run time
+    AccessResult genericAccess(AccessOp op, int addr, int& row_idx) {
+        AccessResult status = AccessResult::SW;
+        // Get Parameters
+        int block_id = addr / block_size;
+        row_idx = block_id % num_rows;
+        uint16_t tag_query = block_id / num_rows;
+
+        if (op == AccessOp::LW) status = handleLW(row_idx, tag_query);
+        else writeCache(row_idx, tag_query, findWay(row_idx, tag_query));
+        return status;
+    }
+
+    /*
+        Specialized for one associativity and block size, so that the block
+        number is a shift, the way search has a constant trip count that
+        the compiler unrolls, and the LRU update works on a known position.
+        With PowerOfTwoRows, the row and tag are a mask and a shift as well.
+    */
+    template <int Assoc, int BlockShift, bool PowerOfTwoRows>
+    AccessResult fixedAccess(AccessOp op, int addr, int& row_idx) {
+        int block_id = addr >> BlockShift;
+        uint16_t tag_query;
+        if (PowerOfTwoRows) {
+            row_idx = block_id & row_mask;
+            tag_query = block_id >> row_shift;
+        } else {
+            row_idx = block_id % num_rows;
+            tag_query = block_id / num_rows;
+        }
+
+        uint16_t* set = &tags[(size_t)row_idx * Assoc];
+        int way = -1;
+        if (Assoc >= 8) {
+            way = find_tag(set, Assoc, tag_query);
+        } else {
+            for (int w = 0; w < Assoc; w++) {
+                if (set[w] == tag_query) way = w; // at most one way matches
+            }
+        }
+
+        uint64_t& set_order = order[row_idx];
+        if (op == AccessOp::LW && way >= 0) {
+            if (Assoc > 1) set_order = moveToFront(set_order, recencyPosition(set_order, way));
+            return AccessResult::HIT;
+        }
+        // Fill, as in writeCache()
+        if (way >= 0) set[way] = INVALID_TAG;
+        set[(set_order >> (4 * (Assoc - 1))) & 15] = tag_query;
+        if (Assoc > 1) set_order = moveToFront(set_order, Assoc - 1);
+        return op == AccessOp::LW ? AccessResult::MISS : AccessResult::SW;
+    }
+
+    // fixedAccess instantiations for associativity 1-16 and block size 1-64 (powers of two)
+    static const Engine fixed_engines[5][7][2];
+
+    // Looks up the specialized engine for a configuration, or falls back to genericAccess
+    static Engine select_engine(int assoc, int block_size, bool power_of_two_rows) {
+        int assoc_idx = -1, shift = -1;
+        for (int i = 0; i < 5; i++) if (assoc == 1 << i) assoc_idx = i;
+        for (int i = 0; i < 7; i++) if (block_size == 1 << i) shift = i;
+        if (assoc_idx < 0 || shift < 0) return &Cache::genericAccess;
+        return fixed_engines[assoc_idx][shift][power_of_two_rows];
+    }
+
+    // Way numbers 0-15 in order, one per 4 bits, starting from the lowest bits
+    static const uint64_t IDENTITY_ORDER = 0xFEDCBA9876543210ULL;
+
+    // The way of the set holding tag_query, or -1
+    int findWay(int row_idx, uint16_t tag_query) const {
+        return find_tag(&tags[(size_t)row_idx * assoc], assoc, tag_query);
+    }
+
+    // Where way stands in a set's recency order, 0 being the most recent
+    static int recencyPosition(uint64_t order, int way) {
+        // Find the 4-bit field equal to way: fields of x are zero where they match
+        const uint64_t ones = 0x1111111111111111ULL;
+        uint64_t x = order ^ (ones * way);
+        uint64_t zero_fields = (x - ones) & ~x & (ones << 3);
+        return lowestBit(zero_fields) / 4; // the lowest flagged field is always a real match
+    }
+
+    // Moves the way at position pos of a recency order to position 0
+    static uint64_t moveToFront(uint64_t order, int pos) {
+        uint64_t newer = order & ((1ULL << (4 * pos)) - 1);
+        uint64_t older = pos == 15 ? 0 : order & ~((1ULL << (4 * pos + 4)) - 1);
+        uint64_t way = (order >> (4 * pos)) & 15;
+        return older | (newer << 4) | way;
+    }
+
+    static int lowestBit(uint64_t x) {
+#if defined(__GNUC__)
+        return __builtin_ctzll(x);
+#else
+        int bit = 0;
+        while (!(x & 1)) { x >>= 1; bit++; }
+        return bit;
+#endif
+    }
+
+    string name;
+    bool is_present;
+    LogWriter* log;
+    AsyncLog* async_log = nullptr;
+    TraceWriter* trace = nullptr;
+    CacheStats counters;
+    int size;
+    int block_size;
+    int assoc;
+    int num_rows;
+    AlignedArray<uint16_t> tags; // num_rows sets of assoc tags; tags never move between ways
+    AlignedArray<uint64_t> order; // per set, way numbers from most to least recently used
+    TagSearch find_tag;
+    int row_shift; // log2(num_rows), when num_rows is a power of two
+    int row_mask;
+    Engine engine;
+};
+
+#define E20_ENGINE_PAIR(A, S) { &Cache::fixedAccess<A, S, false>, &Cache::fixedAccess<A, S, true> }
+#define E20_ENGINE_ROW(A) { E20_ENGINE_PAIR(A, 0), E20_ENGINE_PAIR(A, 1), E20_ENGINE_PAIR(A, 2), \
+        E20_ENGINE_PAIR(A, 3), E20_ENGINE_PAIR(A, 4), E20_ENGINE_PAIR(A, 5), E20_ENGINE_PAIR(A, 6) }
+const Cache::Engine Cache::fixed_engines[5][7][2] = {
+    E20_ENGINE_ROW(1), E20_ENGINE_ROW(2), E20_ENGINE_ROW(4), E20_ENGINE_ROW(8), E20_ENGINE_ROW(16)
+};
+#undef E20_ENGINE_ROW
+#undef E20_ENGINE_PAIR
+
+
+/*
+    Sends one memory access through the cache hierarchy. Every access goes
+    to L1; loads that miss in L1, and all stores, continue on to L2 if it
+    is present.
+
+    @param op The kind of access
+
+    @param addr The memory address being accessed
+
+    @param pc The program counter of the memory access instruction
+*/
+void access_caches(Cache& L1, Cache& L2, AccessOp op, int addr, uint16_t pc) {
+    AccessResult L1_status = L1.access(op, addr, pc);
+
+    if (L1_status != AccessResult::HIT && L2.present()) L2.access(op, addr, pc);
+}
+
+
+/*
+    Sends every access of a trace through the cache hierarchy, in order,
+    without executing anything.
+
+    @param trace The whole trace file, header included. Must pass is_trace
+*/
+void replay_trace(const MappedFile& trace, Cache& L1, Cache& L2) {
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(trace.data()) + sizeof(TRACE_MAGIC);
+    const unsigned char* end = reinterpret_cast<const unsigned char*>(trace.data()) + trace.size();
+    for (; p != end; p += 4) {
+        uint32_t rec = load_le32(p);
+        access_caches(L1, L2, trace_op(rec), trace_addr(rec), trace_pc(rec));
+    }
+}
+
+// Decodes the records of a trace that passes is_trace
+vector<uint32_t> trace_records(const MappedFile& trace) {
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(trace.data()) + sizeof(TRACE_MAGIC);
+    vector<uint32_t> records((trace.size() - sizeof(TRACE_MAGIC)) / 4);
+    for (size_t i = 0; i < records.size(); i++, p += 4) records[i] = load_le32(p);
+    return records;
+}
+
+// Sends records, as captured by a TraceWriter, through the cache hierarchy
+void replay_records(const vector<uint32_t>& records, Cache& L1, Cache& L2) {
+    for (uint32_t rec : records) access_caches(L1, L2, trace_op(rec), trace_addr(rec), trace_pc(rec));
+}
+
+// Below this many records, a parallel replay spends more on starting threads and copying caches than it saves
+const size_t MIN_PARALLEL_REPLAY = 1 << 16;
+
+/*
+    Splits the rows of a cache level between shards, row r going to shard
+    r % count. When the rows, the blocksize and count are all powers of
+    two, that is a shift and a mask of the address.
+*/
+struct RowShards {
+    RowShards(const Cache& level, unsigned jobs) : level(level) {
+        count = level.present() ? (unsigned)min<int>(jobs, level.rows()) : 1;
+        if (!level.present()) return;
+        int block_size = level.span() / level.rows();
+        auto power_of_two = [](unsigned n) { return (n & (n - 1)) == 0; };
+        if (power_of_two(level.rows()) && power_of_two(block_size) && power_of_two(count)) {
+            block_shift = 0;
+            while ((1 << block_shift) < block_size) block_shift++;
+        }
+    }
+
+    unsigned of(int addr) const {
+        if (block_shift >= 0) return ((unsigned)addr >> block_shift) & (count - 1);
+        return (unsigned)level.rowOf(addr) % count;
+    }
+
+    const Cache& level;
+    unsigned count;
+    int block_shift = -1; // log2(blocksize), when the shift and mask apply
+};
+
+/*
+    Replays a trace like replay_trace, but on several threads. Rows never
+    interact, so each worker simulates its own share of L1's rows, then of
+    L2's. The trace is first bucketed by L1 worker, each thread taking a
+    stretch of it, and L1 workers file the accesses they pass on by L2
+    worker, so no worker looks at a record that isn't its own. An L2
+    worker merges what it gets from the L1 workers back into trace order.
+    The log is put back together in trace order afterwards.
+
+    Only the counters of L1 and L2 are updated, not their contents. Traces
+    too short to be worth the threads are replayed by replay_trace instead,
+    which logs through the caches themselves.
+
+    @param trace The whole trace file, header included. Must pass is_trace
+
+    @param jobs The number of threads to use, at most
+
+    @param log Where to print the log, or nullptr for none
+
+    @param async If not nullptr, the log is handed to it instead of printed
+    to log directly
+*/
+void replay_trace_parallel(const MappedFile& trace, Cache& L1, Cache& L2, unsigned jobs, LogWriter* log,
+                           AsyncLog* async = nullptr) {
+    const unsigned char* base = reinterpret_cast<const unsigned char*>(trace.data()) + sizeof(TRACE_MAGIC);
+    size_t count = (trace.size() - sizeof(TRACE_MAGIC)) / 4;
+    RowShards L1_shards(L1, jobs);
+    RowShards L2_shards(L2, jobs);
+    if (count < MIN_PARALLEL_REPLAY || count > UINT32_MAX || (L1_shards.count < 2 && L2_shards.count < 2)) {
+        replay_trace(trace, L1, L2);
+        return;
+    }
+    // Only needed for the log
+    vector<AccessResult> L1_status(log != nullptr ? count : 0);
+    vector<AccessResult> L2_status(log != nullptr && L2.present() ? count : 0);
+
+    // Runs worker(0) to worker(n - 1) at once, on this thread and n - 1 others
+    auto run_workers = [](unsigned n, const function<void(unsigned)>& worker) {
+        vector<thread> pool;
+        for (unsigned w = 1; w < n; w++) pool.emplace_back(worker, w);
+        worker(0);
+        for (thread& t : pool) t.join();
+    };
+
+    // Records are copied out with their place in the trace, so that no worker reads far-apart records
+    struct Entry {
+        uint32_t index;
+        uint32_t rec;
+    };
+    typedef vector<vector<Entry>> Buckets;
+
+    // to_L1[s][w]: the records in stretch s of the trace that L1 worker w simulates, in order
+    unsigned stretches = L1_shards.count;
+    vector<Buckets> to_L1(stretches, Buckets(L1_shards.count));
+    run_workers(stretches, [&](unsigned s) {
+        size_t first = count * s / stretches, last = count * (s + 1) / stretches;
+        for (vector<Entry>& bucket : to_L1[s]) bucket.reserve((last - first) / L1_shards.count + 1);
+        for (size_t i = first; i < last; i++) {
+            uint32_t rec = load_le32(base + 4 * i);
+            to_L1[s][L1_shards.of(trace_addr(rec))].push_back(Entry{(uint32_t)i, rec});
+        }
+    });
+
+    // to_L2[w][v]: the records L1 worker w passes on to L2 worker v, in order
+    vector<Buckets> to_L2(L1_shards.count, Buckets(L2_shards.count));
+    vector<Cache> L1_copies(L1_shards.count, L1);
+    run_workers(L1_shards.count, [&](unsigned w) {
+        Cache& cache = L1_copies[w];
+        cache.stopLogging();
+        for (unsigned s = 0; s < stretches; s++) {
+            for (const Entry& e : to_L1[s][w]) {
+                int addr = trace_addr(e.rec);
+                AccessResult status = cache.access(trace_op(e.rec), addr, trace_pc(e.rec));
+                if (log != nullptr) L1_status[e.index] = status;
+                if (status != AccessResult::HIT && L2.present()) to_L2[w][L2_shards.of(addr)].push_back(e);
+            }
+            vector<Entry>().swap(to_L1[s][w]);
+        }
+    });
+    for (const Cache& copy : L1_copies) L1.addStats(copy.stats());
+
+    if (L2.present()) {
+        vector<Cache> L2_copies(L2_shards.count, L2);
+        run_workers(L2_shards.count, [&](unsigned v) {
+            Cache& cache = L2_copies[v];
+            cache.stopLogging();
+            // Each L1 worker's list is in trace order, so taking the lowest next index of them restores it
+            vector<const Entry*> next(L1_shards.count), last(L1_shards.count);
+            for (unsigned w = 0; w < L1_shards.count; w++) {
+                next[w] = to_L2[w][v].data();
+                last[w] = next[w] + to_L2[w][v].size();
+            }
+            while (true) {
+                unsigned from = L1_shards.count;
+                for (unsigned w = 0; w < L1_shards.count; w++) {
+                    if (next[w] != last[w] && (from == L1_shards.count || next[w]->index < next[from]->index)) from = w;
+                }
+                if (from == L1_shards.count) break;
+                const Entry& e = *next[from]++;
+                AccessResult status = cache.access(trace_op(e.rec), trace_addr(e.rec), trace_pc(e.rec));
+                if (log != nullptr) L2_status[e.index] = status;
+            }
+        });
+        for (const Cache& copy : L2_copies) L2.addStats(copy.stats());
+    }
+
+    if (log == nullptr) return;
+    auto emit = [&](const Cache& level, AccessResult status, int pc, int addr) {
+        if (async != nullptr)
+            async->push(LogRecord{&level.getName(), result_name(status), pc, addr, level.rowOf(addr)});
+        else
+            print_log_entry(*log, level.getName(), result_name(status), pc, addr, level.rowOf(addr));
+    };
+    for (size_t i = 0; i < count; i++) {
+        uint32_t rec = load_le32(base + 4 * i);
+        int addr = trace_addr(rec);
+        emit(L1, L1_status[i], trace_pc(rec), addr);
+        if (L1_status[i] != AccessResult::HIT && L2.present())
+            emit(L2, L2_status[i], trace_pc(rec), addr);
+    }
+}
+
+
+/*
+    Operations of the E20 instruction set, after decoding. Three-register
+    instructions are split out by their func field, so a single value
+    identifies what an instruction does. Unknown func values decode to OP_NOP.
+*/
+enum Operation : uint8_t {
+    OP_ADD, OP_SUB, OP_OR, OP_AND, OP_SLT, OP_JR, OP_NOP,
+    OP_ADDI, OP_J, OP_JAL, OP_LW, OP_SW, OP_JEQ, OP_SLTI
+};
+
+/*
+    A predecoded instruction. imm holds the sign-extended imm7 field, or the
+    zero-extended imm13 field for j and jal.
+*/
+struct DecodedIns {
+    uint8_t op;
+    uint8_t rA;
+    uint8_t rB;
+    uint8_t rC;
+    uint16_t imm;
+};
+
+/*
+    Breaks a machine code word down into a DecodedIns.
+
+    @param ins The 16-bit instruction word
+*/
+DecodedIns decode(uint16_t ins) {
+    DecodedIns d;
+
+    //Control parameters
+    uint16_t opCode = ins >> 13;
+    uint16_t func = ins & 15;
+
+    //Registers
+    d.rA = (ins >> 10) & 7;
+    d.rB = (ins >> 7) & 7;
+    d.rC = (ins >> 4) & 7;
+
+    //Immediate Values
+    uint16_t imm7 = ins & 127;
+    if (imm7 & 64) imm7 |= 65408; // Sign extend 7 if its negative
+    d.imm = imm7;
+
+    if (opCode == 0b000) {
+        if (func == 0b0000) d.op = OP_ADD;
+        else if (func == 0b0001) d.op = OP_SUB;
+        else if (func == 0b0010) d.op = OP_OR;
+        else if (func == 0b0011) d.op = OP_AND;
+        else if (func == 0b0100) d.op = OP_SLT;
+        else if (func == 0b1000) d.op = OP_JR;
+        else d.op = OP_NOP;
+    } else if (opCode == 0b001) d.op = OP_ADDI;
+    else if (opCode == 0b010) d.op = OP_J;
+    else if (opCode == 0b011) d.op = OP_JAL;
+    else if (opCode == 0b100) d.op = OP_LW;
+    else if (opCode == 0b101) d.op = OP_SW;
+    else if (opCode == 0b110) d.op = OP_JEQ;
+    else d.op = OP_SLTI;
+
+    if (d.op == OP_J || d.op == OP_JAL) d.imm = ins & 0x1FFF; // Zero extend imm13
+    return d;
+}
+
+/*
+    Decodes every word of memory, so that the simulator does not have to
+    break the same instruction down each time it executes. Must be redone
+    for a single cell whenever that cell is written.
+
+    @param mem The memory image, MEM_SIZE words
+
+    @param decoded Output array of MEM_SIZE decoded instructions
+*/
+void predecode(const uint16_t mem[], DecodedIns decoded[]) {
+    for (size_t addr = 0; addr < MEM_SIZE; addr++)
+        decoded[addr] = decode(mem[addr]);
+}
+
+
+// A budget of instructions that is never used up
+const uint64_t NO_LIMIT = UINT64_MAX;
+
+/*
+    Runs the program until it halts, or until it has run budget
+    instructions.
+
+    @param budget The most instructions to run. Reduced by the number run
+
+    @return Whether the program halted
+*/
+bool sim(uint16_t& pc, uint16_t regs[], uint16_t mem[], DecodedIns decoded[], Cache& L1, Cache& L2,
+         uint64_t& budget) {
+
+    bool halt = false; //Set a flag for halt instruction
+
+    while (!halt) { //Continue to run until halt is flagged
+        if (budget == 0) return false;
+        budget--;
+
+        //Fetch the predecoded instruction at current Program Counter
+        const DecodedIns& ins = decoded[pc & 8191]; //Read only 13 bits of pc
+        uint16_t op = ins.op;
+        uint16_t rA = ins.rA, rB = ins.rB, rC = ins.rC;
+        uint16_t imm = ins.imm;
+        uint16_t addr = (regs[rA] + imm) & 8191;
+
+        //Defaulted increment of Program counter
+        uint16_t new_pc = pc + 1;
+
+        // Three reg instructions (add, sub, or, and, slt, jr)
+        if (op == OP_ADD) regs[rC] = regs[rA] + regs[rB]; // add
+
+        else if (op == OP_SUB) regs[rC] = regs[rA] - regs[rB]; // sub
+
+        else if (op == OP_OR) regs[rC] = regs[rA] | regs[rB]; // or
+
+        else if (op == OP_AND) regs[rC] = regs[rA] & regs[rB]; // and
+
+        else if (op == OP_SLT) regs[rC] = (regs[rA] < regs[rB]) ? 1 : 0; //slt
+
+        else if (op == OP_JR) new_pc = regs[rA]; // jr
+
+        // Two reg instructions
+        else if (op == OP_ADDI) regs[rB] = regs[rA] + imm;// addi
+
+        else if (op == OP_J) new_pc = imm; //j
+
+        else if (op == OP_LW) {// lw
+            access_caches(L1, L2, AccessOp::LW, addr, pc);
+            regs[rB] = mem[addr];
+        } else if (op == OP_SW) {// sw
+            access_caches(L1, L2, AccessOp::SW, addr, pc);
+            mem[addr] = regs[rB];
+            decoded[addr] = decode(regs[rB]); // the stored word may be executed later
+        } else if (op == OP_JEQ) new_pc = regs[rA] == regs[rB] ? (pc + 1 + imm) : pc + 1;// jeq
+
+        else if (op == OP_SLTI) regs[rB] = regs[rA] < imm;// slti
+
+        else if (op == OP_JAL) { // jal
+            regs[7] = pc + 1;
+            new_pc = imm;
+        }
+
+        //Check for halt condition
+        halt = (pc & 8191) == new_pc;
+
+        // Update Program counter, if halt is false
+        if (!halt) pc = new_pc;
+
+        // Reset Rg0
+        regs[0] = 0;
+    }
+    return true;
+}
+
+// Build with -DE20_NO_COMPUTED_GOTO to force the portable switch dispatch
+#if defined(__GNUC__) && !defined(E20_NO_COMPUTED_GOTO)
+#define E20_COMPUTED_GOTO 1 // labels-as-values are a GCC/Clang extension
+#endif
+
+/*
+    Alternate execution core with the same behavior as sim(). Instead of
+    walking an if/else chain for every instruction, each handler jumps
+    straight to the handler of the next instruction through a table indexed
+    by the predecoded operation (threaded dispatch). Compilers without
+    computed goto get an equivalent switch-based loop.
+*/
+void sim_threaded(uint16_t& pc, uint16_t regs[], uint16_t mem[], DecodedIns decoded[], Cache& L1, Cache& L2) {
+    const DecodedIns* ins;
+
+#ifdef E20_COMPUTED_GOTO
+    // Must list a label for every Operation, in declaration order
+    static void* const handlers[] = {
+        &&do_OP_ADD, &&do_OP_SUB, &&do_OP_OR, &&do_OP_AND, &&do_OP_SLT, &&do_OP_JR, &&do_OP_NOP,
+        &&do_OP_ADDI, &&do_OP_J, &&do_OP_JAL, &&do_OP_LW, &&do_OP_SW, &&do_OP_JEQ, &&do_OP_SLTI
+    };
+#define HANDLER(op) do_##op:
+#define DISPATCH() { ins = &decoded[pc & 8191]; goto *handlers[ins->op]; }
+    DISPATCH();
+#else
+#define HANDLER(op) case op:
+#define DISPATCH() continue;
+    for (;;) {
+        ins = &decoded[pc & 8191];
+        switch (ins->op) {
+#endif
+
+// Falls through to the next instruction. Only jumps can halt.
+#define NEXT() { regs[0] = 0; pc++; DISPATCH(); }
+// Halts on a jump to the current instruction, as in sim()
+#define JUMP(target) { uint16_t new_pc = (target); regs[0] = 0; \
+        if ((pc & 8191) == new_pc) { return; } pc = new_pc; DISPATCH(); }
+
+    HANDLER(OP_ADD) regs[ins->rC] = regs[ins->rA] + regs[ins->rB]; NEXT();
+    HANDLER(OP_SUB) regs[ins->rC] = regs[ins->rA] - regs[ins->rB]; NEXT();
+    HANDLER(OP_OR) regs[ins->rC] = regs[ins->rA] | regs[ins->rB]; NEXT();
+    HANDLER(OP_AND) regs[ins->rC] = regs[ins->rA] & regs[ins->rB]; NEXT();
+    HANDLER(OP_SLT) regs[ins->rC] = (regs[ins->rA] < regs[ins->rB]) ? 1 : 0; NEXT();
+    HANDLER(OP_JR) JUMP(regs[ins->rA]);
+    HANDLER(OP_NOP) NEXT();
+    HANDLER(OP_ADDI) regs[ins->rB] = regs[ins->rA] + ins->imm; NEXT();
+    HANDLER(OP_J) JUMP(ins->imm);
+    HANDLER(OP_JAL) regs[7] = pc + 1; JUMP(ins->imm);
+    HANDLER(OP_LW) {
+        uint16_t addr = (regs[ins->rA] + ins->imm) & 8191;
+        access_caches(L1, L2, AccessOp::LW, addr, pc);
+        regs[ins->rB] = mem[addr];
+        NEXT();
+    }
+    HANDLER(OP_SW) {
+        uint16_t addr = (regs[ins->rA] + ins->imm) & 8191;
+        access_caches(L1, L2, AccessOp::SW, addr, pc);
+        mem[addr] = regs[ins->rB];
+        decoded[addr] = decode(regs[ins->rB]);
+        NEXT();
+    }
+    HANDLER(OP_JEQ) JUMP(regs[ins->rA] == regs[ins->rB] ? (pc + 1 + ins->imm) : pc + 1);
+    HANDLER(OP_SLTI) regs[ins->rB] = regs[ins->rA] < ins->imm; NEXT();
+
+#ifndef E20_COMPUTED_GOTO
+        }
+    }
+#endif
+#undef HANDLER
+#undef DISPATCH
+#undef NEXT
+#undef JUMP
+}
+
+
+/*
+    Micro-operations of the basic-block core. The first values match
+    Operation; the rest are superinstructions that run a common pair of
+    instructions in one dispatch, and UOP_EXIT, which ends a block that was
+    cut off without a jump.
+*/
+enum MicroOpKind : uint8_t {
+    UOP_ADD_LW = OP_SLTI + 1, // add, then lw
+    UOP_ADDI_JEQ,             // addi, then jeq
+    UOP_EXIT
+};
+
+/*
+    One step of a translated block. offset is the distance in words from the
+    block's entry to (the first instruction of) this step.
+*/
+struct MicroOp {
+    uint8_t kind;
+    uint16_t offset;
+    DecodedIns a;
+    DecodedIns b; // second instruction of a superinstruction
+};
+
+struct JitContext;
+class Jit;
+typedef uint32_t (*NativeBlock)(JitContext*);
+
+/*
+    A translated basic block: a straight run of instructions ending at
+    j, jal, jr or jeq (which includes the halt self-jump), or cut off
+    after MAX_LENGTH instructions.
+*/
+struct Block {
+    static const uint16_t MAX_LENGTH = 64;
+    uint16_t entry;  // address of the first instruction, 13 bits
+    uint16_t length; // number of instructions covered
+    vector<MicroOp> ops;
+    uint32_t runs = 0;             // times entered, to find hot blocks for the JIT
+    NativeBlock native = nullptr;  // JIT-compiled code, if any
+    vector<uint16_t> extra;        // words outside the block that native was compiled from
+};
+
+/*
+    Translated blocks, looked up by the 13-bit address of their first
+    instruction. Blocks are built on first use from the predecoded
+    instructions, and dropped when a sw writes any word they cover.
+*/
+class BlockCache {
+public:
+    BlockCache(const DecodedIns decoded[]) : decoded(decoded), blocks(MEM_SIZE), coverage(MEM_SIZE, 0),
+                                           extra_owners(MEM_SIZE) {}
+
+    Block* lookup(uint16_t entry) {
+        if (!blocks[entry]) translate(entry);
+        return blocks[entry].get();
+    }
+
+    /*
+        Drops every block that covers addr. Blocks are kept alive until the
+        next call to collect(), since one of them may still be executing.
+
+        @return Whether any block was dropped
+    */
+    bool invalidate(uint16_t addr) {
+        if (coverage[addr] == 0) return false;
+        // Only blocks starting up to MAX_LENGTH - 1 words before addr, or
+        // listed as having addr as an extra word, can cover it
+        for (uint16_t back = 0; back < Block::MAX_LENGTH; back++) {
+            uint16_t entry = (addr - back) & 8191;
+            if (blocks[entry] && back < blocks[entry]->length) drop(entry);
+        }
+        for (uint16_t entry : extra_owners[addr]) { // may list blocks already dropped
+            Block* b = blocks[entry].get();
+            if (b != nullptr && find(b->extra.begin(), b->extra.end(), addr) != b->extra.end()) drop(entry);
+        }
+        extra_owners[addr].clear();
+        return true;
+    }
+
+    // Makes writes to words also invalidate b, once native code depends on them
+    void extend(Block* b, const vector<uint16_t>& words) {
+        for (uint16_t word : words) {
+            if (((word - b->entry) & 8191) < b->length) continue;
+            if (find(b->extra.begin(), b->extra.end(), word) != b->extra.end()) continue;
+            b->extra.push_back(word);
+            extra_owners[word].push_back(b->entry);
+            coverage[word]++;
+        }
+    }
+
+    void collect() { graveyard.clear(); }
+
+    // Drops all JIT-compiled code, after the JIT has reused its memory
+    void forget_native() {
+        for (size_t entry = 0; entry < MEM_SIZE; entry++)
+            if (blocks[entry]) blocks[entry]->native = nullptr;
+    }
+
+private:
+    void drop(uint16_t entry) {
+        Block* b = blocks[entry].get();
+        for (uint16_t i = 0; i < b->length; i++) coverage[(entry + i) & 8191]--;
+        for (uint16_t word : b->extra) coverage[word]--;
+        graveyard.push_back(move(blocks[entry]));
+    }
+
+    static bool ends_block(uint8_t op) {
+        return op == OP_J || op == OP_JAL || op == OP_JR || op == OP_JEQ;
+    }
+
+    void translate(uint16_t entry) {
+        unique_ptr<Block> b(new Block());
+        b->entry = entry;
+        uint16_t len = 0;
+        while (true) {
+            const DecodedIns& ins = decoded[(entry + len) & 8191];
+            const DecodedIns& following = decoded[(entry + len + 1) & 8191];
+            MicroOp u;
+            u.kind = ins.op;
+            u.offset = len;
+            u.a = ins;
+            len++;
+            if (len < Block::MAX_LENGTH && ins.op == OP_ADD && following.op == OP_LW) {
+                u.kind = UOP_ADD_LW;
+                u.b = following;
+                len++;
+            } else if (len < Block::MAX_LENGTH && ins.op == OP_ADDI && following.op == OP_JEQ) {
+                u.kind = UOP_ADDI_JEQ;
+                u.b = following;
+                len++;
+            }
+            b->ops.push_back(u);
+            if (ends_block(ins.op) || u.kind == UOP_ADDI_JEQ) break;
+            if (len >= Block::MAX_LENGTH) {
+                MicroOp exit;
+                exit.kind = UOP_EXIT;
+                exit.offset = len;
+                b->ops.push_back(exit);
+                break;
+            }
+        }
+        b->length = len;
+        for (uint16_t i = 0; i < len; i++) coverage[(entry + i) & 8191]++;
+        blocks[entry] = move(b);
+    }
+
+    const DecodedIns* decoded;
+    vector<unique_ptr<Block> > blocks;
+    vector<uint16_t> coverage; // number of blocks covering each word
+    vector<unique_ptr<Block> > graveyard;
+    vector<vector<uint16_t> > extra_owners; // entries of blocks that listed each word as extra
+};
+
+
+#ifdef E20_JIT
+/*
+    State shared between the dispatcher and native blocks. regs must stay
+    the first member: generated code loads it from offset 0.
+*/
+struct JitContext {
+    uint16_t* regs;
+    uint16_t* mem;
+    DecodedIns* decoded;
+    Cache* L1;
+    Cache* L2;
+    BlockCache* blocks;
+};
+
+// Called from native code for every lw. Returns the loaded word.
+static uint32_t jit_lw(JitContext* ctx, uint32_t addr, uint32_t pc) {
+    access_caches(*ctx->L1, *ctx->L2, AccessOp::LW, addr, pc);
+    return ctx->mem[addr];
+}
+
+// Called from native code for every sw. Returns nonzero if it overwrote translated code.
+static uint32_t jit_sw(JitContext* ctx, uint32_t addr, uint32_t pc, uint32_t value) {
+    access_caches(*ctx->L1, *ctx->L2, AccessOp::SW, addr, pc);
+    ctx->mem[addr] = value;
+    ctx->decoded[addr] = decode(value);
+    return ctx->blocks->invalidate(addr);
+}
+
+/*
+    Compiles hot basic blocks into x86-64 machine code. Compilation starts
+    at the block's entry and follows the path through j, jal and not-taken
+    jeq instructions, so a whole loop body usually becomes one trace whose
+    back edge is a native jump.
+
+    Guest registers $1-$6 live in the callee-saved host registers for the
+    whole block and $7 in r10, which is spilled around helper calls; $0 is
+    never stored, since it always reads as zero. eax and ecx are scratch.
+    Values are kept zero-extended to 32 bits. Only the registers a block
+    touches are saved, loaded and written back.
+
+    A native block returns (pc of the last instruction run << 16) | next pc,
+    so that the dispatcher can apply the same halt check as sim().
+*/
+class Jit {
+public:
+    static const uint32_t THRESHOLD = 16; // runs of a block before it is compiled
+    static const size_t ARENA_SIZE = 4 << 20;
+
+    Jit() {
+        void* p = mmap(nullptr, ARENA_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        arena = p == MAP_FAILED ? nullptr : static_cast<uint8_t*>(p);
+        arena_used = 0;
+    }
+
+    ~Jit() {
+        if (arena != nullptr) munmap(arena, ARENA_SIZE);
+    }
+
+    bool available() const { return arena != nullptr; }
+
+    /*
+        Generates native code for a block entered at pc == b->entry.
+
+        @return The compiled code, or nullptr if the arena was full; in that
+            case the arena has been emptied, and every existing native pointer
+            must be dropped before compiling again.
+    */
+    NativeBlock compile(const Block& b, const DecodedIns decoded[], vector<uint16_t>& words) {
+        find_trace(b, decoded);
+        words.clear();
+        for (const TraceStep& step : trace) words.push_back(step.pc & 8191);
+
+        code.clear();
+        labels.clear();
+        prologue();
+        for (const TraceStep& step : trace) {
+            labels.push_back(make_pair(step.pc, code.size()));
+            emit_instruction(step);
+        }
+        return install();
+    }
+
+private:
+    static const size_t MAX_TRACE = 256;
+
+    /*
+        One instruction of a trace. next is the pc that the trace continues
+        at (after a jump, or when jeq is not taken), and ends is set when the
+        trace stops after this instruction instead.
+    */
+    struct TraceStep {
+        uint16_t pc;
+        DecodedIns ins;
+        uint16_t next;
+        bool ends;
+    };
+
+    enum HostReg { EAX = 0, ECX = 1, EDX = 2, EBX = 3, ESP = 4, EBP = 5, ESI = 6, EDI = 7,
+                   R10 = 10, R12 = 12, R13 = 13, R14 = 14, R15 = 15 };
+
+    static int host(int guest) {
+        static const int map[NUM_REGS] = {-1, EBX, EBP, R12, R13, R14, R15, R10};
+        return map[guest];
+    }
+
+    /*
+        Follows execution from the block's entry through unconditional jumps
+        and not-taken jeqs, until a jr, a halt, an instruction already in the
+        trace, or MAX_TRACE instructions. Also finds which guest registers the
+        trace reads or writes, and which it writes.
+    */
+    void find_trace(const Block& b, const DecodedIns decoded[]) {
+        trace.clear();
+        traced.assign(MEM_SIZE, false);
+        used = written = 0;
+        uint16_t pc = b.entry;
+        while (true) {
+            TraceStep step;
+            step.pc = pc;
+            step.ins = decoded[pc & 8191];
+            const DecodedIns& ins = step.ins;
+            step.next = pc + 1;
+            if (ins.op == OP_J || ins.op == OP_JAL) step.next = ins.imm;
+            step.ends = ins.op == OP_JR || ((ins.op == OP_J || ins.op == OP_JAL) && (pc & 8191) == ins.imm);
+
+            unsigned reads = 0, writes = 0;
+            if (ins.op <= OP_SLT) { reads = (1 << ins.rA) | (1 << ins.rB); writes = 1 << ins.rC; }
+            else if (ins.op == OP_JR) reads = 1 << ins.rA;
+            else if (ins.op == OP_ADDI || ins.op == OP_SLTI || ins.op == OP_LW) { reads = 1 << ins.rA; writes = 1 << ins.rB; }
+            else if (ins.op == OP_SW || ins.op == OP_JEQ) reads = (1 << ins.rA) | (1 << ins.rB);
+            else if (ins.op == OP_JAL) writes = 1 << 7;
+            used |= (reads | writes) & ~1u;
+            written |= writes & ~1u;
+
+            if (!step.ends && (trace.size() + 1 >= MAX_TRACE || in_trace(step.next) || step.next == pc))
+                step.ends = true;
+            trace.push_back(step);
+            traced[pc & 8191] = true;
+            if (step.ends) return;
+            pc = step.next;
+        }
+    }
+
+    bool in_trace(uint16_t pc) const {
+        if (!traced[pc & 8191]) return false;
+        for (const TraceStep& step : trace)
+            if (step.pc == pc) return true;
+        return false;
+    }
+
+    bool saved(int guest) const { return (used >> guest) & 1 && host(guest) != R10; }
+
+    // Size of the stack frame below the saved registers, keeping calls 16-byte aligned
+    int frame_size() const {
+        int pushes = 0;
+        for (int g = 1; g < (int)NUM_REGS; g++) pushes += saved(g);
+        return pushes % 2 == 0 ? 24 : 16;
+    }
+
+    void byte(uint8_t b) { code.push_back(b); }
+
+    void imm32(uint32_t v) {
+        for (int i = 0; i < 4; i++) byte(v >> (8 * i));
+    }
+
+    void rex(bool w, int reg, int rm) {
+        uint8_t r = 0x40 | (w << 3) | ((reg >> 3) << 2) | (rm >> 3);
+        if (r != 0x40) byte(r);
+    }
+
+    // op r/m32, r32 with both operands registers (mov 0x89, add 0x01, or 0x09, and 0x21, sub 0x29, cmp 0x39)
+    void op_rr(uint8_t op, int dst, int src) {
+        rex(false, src, dst);
+        byte(op);
+        byte(0xC0 | ((src & 7) << 3) | (dst & 7));
+    }
+
+    void mov_ri(int dst, uint32_t v) {
+        rex(false, 0, dst);
+        byte(0xB8 | (dst & 7));
+        imm32(v);
+    }
+
+    void load_guest(int scratch, int guest) {
+        if (guest == 0) mov_ri(scratch, 0);
+        else op_rr(0x89, scratch, host(guest));
+    }
+
+    void store_guest(int guest, int scratch) {
+        if (guest != 0) op_rr(0x89, host(guest), scratch);
+    }
+
+    void movzx_eax_ax() { byte(0x0F); byte(0xB7); byte(0xC0); }
+
+    // eax = (eax < ecx), unsigned
+    void setb_eax() {
+        byte(0x0F); byte(0x92); byte(0xC0); // setb al
+        byte(0x0F); byte(0xB6); byte(0xC0); // movzx eax, al
+    }
+
+    // Saves the host registers the block uses and loads its guest registers
+    void prologue() {
+        for (int g = 1; g < (int)NUM_REGS; g++) {       // push host
+            if (!saved(g)) continue;
+            rex(false, 0, host(g));
+            byte(0x50 | (host(g) & 7));
+        }
+        byte(0x48); byte(0x83); byte(0xEC); byte(frame_size()); // sub rsp, frame
+        byte(0x48); byte(0x89); byte(0x3C); byte(0x24); // mov [rsp], rdi
+        byte(0x48); byte(0x8B); byte(0x07);             // mov rax, [rdi]
+        for (int g = 1; g < (int)NUM_REGS; g++) {       // movzx host, word [rax + 2g]
+            if (!((used >> g) & 1)) continue;
+            rex(false, host(g), EAX);
+            byte(0x0F); byte(0xB7); byte(0x40 | ((host(g) & 7) << 3)); byte(2 * g);
+        }
+    }
+
+    // Writes the guest registers back and returns eax
+    void epilogue() {
+        if (written != 0) {
+            byte(0x48); byte(0x8B); byte(0x14); byte(0x24); // mov rdx, [rsp]
+            byte(0x48); byte(0x8B); byte(0x12);             // mov rdx, [rdx]
+        }
+        for (int g = 1; g < (int)NUM_REGS; g++) {       // mov word [rdx + 2g], host
+            if (!((written >> g) & 1)) continue;
+            byte(0x66);
+            rex(false, host(g), EDX);
+            byte(0x89); byte(0x42 | ((host(g) & 7) << 3)); byte(2 * g);
+        }
+        byte(0x48); byte(0x83); byte(0xC4); byte(frame_size()); // add rsp, frame
+        for (int g = NUM_REGS - 1; g >= 1; g--) {       // pop host
+            if (!saved(g)) continue;
+            rex(false, 0, host(g));
+            byte(0x58 | (host(g) & 7));
+        }
+        byte(0xC3);                                     // ret
+    }
+
+    /*
+        Goes on to a known pc. A jump back to code already emitted for that
+        pc stays in native code; anything else returns to the dispatcher.
+    */
+    void exit_const(uint16_t last_pc, uint16_t new_pc) {
+        if ((last_pc & 8191) != new_pc) { // not a halt
+            for (const pair<uint16_t, size_t>& label : labels) {
+                if (label.first != new_pc) continue;
+                byte(0xE9);                             // jmp label
+                imm32(label.second - (code.size() + 4));
+                return;
+            }
+        }
+        exit_to_dispatcher(last_pc, new_pc);
+    }
+
+    void exit_to_dispatcher(uint16_t last_pc, uint16_t new_pc) {
+        mov_ri(EAX, ((uint32_t)last_pc << 16) | new_pc);
+        epilogue();
+    }
+
+    // Calls fn(ctx, esi, edx, ecx), preserving $7
+    void call_helper(const void* fn) {
+        bool keep7 = (used >> 7) & 1;
+        if (keep7) { byte(0x44); byte(0x89); byte(0x54); byte(0x24); byte(0x08); } // mov [rsp+8], r10d
+        byte(0x48); byte(0x8B); byte(0x3C); byte(0x24);             // mov rdi, [rsp]
+        byte(0x48); byte(0xB8);                                     // mov rax, fn
+        uint64_t target = reinterpret_cast<uint64_t>(fn);
+        for (int i = 0; i < 8; i++) byte(target >> (8 * i));
+        byte(0xFF); byte(0xD0);                                     // call rax
+        if (keep7) { byte(0x44); byte(0x8B); byte(0x54); byte(0x24); byte(0x08); } // mov r10d, [rsp+8]
+    }
+
+    // esi = (guest rA + imm) & 8191, edx = pc
+    void memory_operands(const DecodedIns& ins, uint16_t this_pc) {
+        load_guest(EAX, ins.rA);
+        byte(0x05); imm32(ins.imm);     // add eax, imm
+        byte(0x25); imm32(8191);        // and eax, 8191
+        op_rr(0x89, ESI, EAX);
+        mov_ri(EDX, this_pc);
+    }
+
+    // Emits one step of the trace, and the way out if the trace ends there
+    void emit_instruction(const TraceStep& step) {
+        const DecodedIns& ins = step.ins;
+        uint16_t this_pc = step.pc;
+        switch (ins.op) {
+        case OP_ADD: case OP_SUB: case OP_OR: case OP_AND: case OP_SLT: {
+            static const uint8_t alu[] = {0x01, 0x29, 0x09, 0x21, 0x39};
+            load_guest(EAX, ins.rA);
+            load_guest(ECX, ins.rB);
+            op_rr(alu[ins.op - OP_ADD], EAX, ECX);
+            if (ins.op == OP_SLT) setb_eax();
+            else movzx_eax_ax();
+            store_guest(ins.rC, EAX);
+            break;
+        }
+        case OP_NOP:
+            break;
+        case OP_ADDI:
+            load_guest(EAX, ins.rA);
+            byte(0x05); imm32(ins.imm); // add eax, imm
+            movzx_eax_ax();
+            store_guest(ins.rB, EAX);
+            break;
+        case OP_SLTI:
+            load_guest(EAX, ins.rA);
+            byte(0x3D); imm32(ins.imm); // cmp eax, imm
+            setb_eax();
+            store_guest(ins.rB, EAX);
+            break;
+        case OP_LW:
+            memory_operands(ins, this_pc);
+            call_helper(reinterpret_cast<const void*>(&jit_lw));
+            store_guest(ins.rB, EAX);
+            break;
+        case OP_SW: {
+            memory_operands(ins, this_pc);
+            load_guest(ECX, ins.rB);
+            call_helper(reinterpret_cast<const void*>(&jit_sw));
+            byte(0x85); byte(0xC0);             // test eax, eax
+            byte(0x0F); byte(0x84);             // jz over the exit
+            size_t patch = code.size();
+            imm32(0);
+            exit_to_dispatcher(this_pc, this_pc + 1); // code was overwritten: leave now
+            patch_rel32(patch);
+            break;
+        }
+        case OP_J:
+            break;
+        case OP_JAL:
+            mov_ri(host(7), (uint16_t)(this_pc + 1));
+            break;
+        case OP_JR:
+            load_guest(EAX, ins.rA);
+            byte(0x0D); imm32((uint32_t)this_pc << 16); // or eax, this_pc << 16
+            epilogue();
+            return;
+        case OP_JEQ: {
+            load_guest(EAX, ins.rA);
+            load_guest(ECX, ins.rB);
+            op_rr(0x39, EAX, ECX);              // cmp eax, ecx
+            byte(0x0F); byte(0x85);             // jne not_taken
+            size_t patch = code.size();
+            imm32(0);
+            exit_const(this_pc, this_pc + 1 + ins.imm);
+            patch_rel32(patch);
+            break;
+        }
+        }
+        if (step.ends) exit_const(this_pc, step.next);
+    }
+
+    // Points the rel32 field at patch to the current end of the code
+    void patch_rel32(size_t patch) {
+        uint32_t rel = code.size() - (patch + 4);
+        for (int i = 0; i < 4; i++) code[patch + i] = rel >> (8 * i);
+    }
+
+    NativeBlock install() {
+        if (arena_used + code.size() > ARENA_SIZE) {
+            arena_used = 0;
+            return nullptr;
+        }
+        uint8_t* dst = arena + arena_used;
+        copy(code.begin(), code.end(), dst);
+        arena_used += code.size();
+        return reinterpret_cast<NativeBlock>(dst);
+    }
+
+    uint8_t* arena;
+    size_t arena_used;
+    vector<uint8_t> code;
+    vector<TraceStep> trace;
+    vector<bool> traced; // by 13-bit address, whether a word is in the trace
+    vector<pair<uint16_t, size_t> > labels; // pc and code offset of each instruction emitted so far
+    unsigned used;     // bit g set if the trace reads or writes guest register g
+    unsigned written;  // bit g set if the trace writes guest register g
+};
+#endif
+
+
+/*
+    Basic-block execution core, with the same behavior as sim(). Each block
+    is translated once into a sequence of micro-ops, with common instruction
+    pairs fused into superinstructions, and then runs without fetching,
+    bounds-masking or halt-checking the instructions inside it.
+
+    @param jit If not null, blocks entered Jit::THRESHOLD times are compiled
+        to native code, which then runs in place of the micro-ops
+*/
+void sim_blocks(uint16_t& pc, uint16_t regs[], uint16_t mem[], DecodedIns decoded[], Cache& L1, Cache& L2,
+                Jit* jit = nullptr) {
+    BlockCache block_cache(decoded);
+    Block* b;
+    const MicroOp* u;
+#ifdef E20_JIT
+    JitContext ctx = {regs, mem, decoded, &L1, &L2, &block_cache};
+#endif
+
+#ifdef E20_COMPUTED_GOTO
+    // Must list a label for every Operation and MicroOpKind, in declaration order
+    static void* const handlers[] = {
+        &&do_OP_ADD, &&do_OP_SUB, &&do_OP_OR, &&do_OP_AND, &&do_OP_SLT, &&do_OP_JR, &&do_OP_NOP,
+        &&do_OP_ADDI, &&do_OP_J, &&do_OP_JAL, &&do_OP_LW, &&do_OP_SW, &&do_OP_JEQ, &&do_OP_SLTI,
+        &&do_UOP_ADD_LW, &&do_UOP_ADDI_JEQ, &&do_UOP_EXIT
+    };
+#define HANDLER(kind) do_##kind:
+#define DISPATCH() goto *handlers[u->kind];
+#else
+#define HANDLER(kind) case kind:
+#define DISPATCH() continue;
+#endif
+
+// Enters the block starting at pc, translating it if needed
+#define ENTER() goto enter;
+// Moves on to the next micro-op of the current block
+#define NEXT() { regs[0] = 0; u++; DISPATCH(); }
+// Leaves the block through a jump; halts on a jump to the jump itself
+#define JUMP(target) { uint16_t this_pc = pc + u->offset; uint16_t new_pc = (target); regs[0] = 0; \
+        if ((this_pc & 8191) == new_pc) { pc = this_pc; return; } pc = new_pc; ENTER(); }
+
+    // Instruction bodies, shared by single instructions and superinstructions
+#define DO_ADD(i) regs[(i).rC] = regs[(i).rA] + regs[(i).rB];
+#define DO_ADDI(i) regs[(i).rB] = regs[(i).rA] + (i).imm;
+#define DO_LW(i, offs) { uint16_t addr = (regs[(i).rA] + (i).imm) & 8191; \
+        access_caches(L1, L2, AccessOp::LW, addr, pc + (offs)); regs[(i).rB] = mem[addr]; }
+#define JEQ_TARGET(i, offs) (regs[(i).rA] == regs[(i).rB] ? (pc + (offs) + 1 + (i).imm) : pc + (offs) + 1)
+
+enter:
+    block_cache.collect();
+    b = block_cache.lookup(pc & 8191);
+#ifdef E20_JIT
+    if (jit != nullptr && pc < MEM_SIZE) { // native code is generated for pc == entry
+        if (b->native == nullptr && ++b->runs >= Jit::THRESHOLD) {
+            vector<uint16_t> words;
+            b->native = jit->compile(*b, decoded, words);
+            if (b->native == nullptr) block_cache.forget_native(); // the JIT ran out of memory and started over
+            else block_cache.extend(b, words);
+        }
+        if (b->native != nullptr) {
+            uint32_t result = b->native(&ctx);
+            uint16_t last_pc = result >> 16;
+            uint16_t new_pc = result & 0xFFFF;
+            if ((last_pc & 8191) == new_pc) {
+                pc = last_pc;
+                return;
+            }
+            pc = new_pc;
+            goto enter;
+        }
+    }
+#endif
+    u = b->ops.data();
+#ifdef E20_COMPUTED_GOTO
+    DISPATCH();
+#else
+    for (;;) {
+        switch (u->kind) {
+#endif
+
+    HANDLER(OP_ADD) DO_ADD(u->a); NEXT();
+    HANDLER(OP_SUB) regs[u->a.rC] = regs[u->a.rA] - regs[u->a.rB]; NEXT();
+    HANDLER(OP_OR) regs[u->a.rC] = regs[u->a.rA] | regs[u->a.rB]; NEXT();
+    HANDLER(OP_AND) regs[u->a.rC] = regs[u->a.rA] & regs[u->a.rB]; NEXT();
+    HANDLER(OP_SLT) regs[u->a.rC] = (regs[u->a.rA] < regs[u->a.rB]) ? 1 : 0; NEXT();
+    HANDLER(OP_JR) JUMP(regs[u->a.rA]);
+    HANDLER(OP_NOP) NEXT();
+    HANDLER(OP_ADDI) DO_ADDI(u->a); NEXT();
+    HANDLER(OP_J) JUMP(u->a.imm);
+    HANDLER(OP_JAL) regs[7] = pc + u->offset + 1; JUMP(u->a.imm);
+    HANDLER(OP_LW) DO_LW(u->a, u->offset); NEXT();
+    HANDLER(OP_SW) {
+        uint16_t addr = (regs[u->a.rA] + u->a.imm) & 8191;
+        access_caches(L1, L2, AccessOp::SW, addr, pc + u->offset);
+        mem[addr] = regs[u->a.rB];
+        decoded[addr] = decode(regs[u->a.rB]);
+        if (block_cache.invalidate(addr)) { // code was overwritten, retranslate from the next instruction
+            regs[0] = 0;
+            pc += u->offset + 1;
+            ENTER();
+        }
+        NEXT();
+    }
+    HANDLER(OP_JEQ) JUMP(JEQ_TARGET(u->a, u->offset));
+    HANDLER(OP_SLTI) regs[u->a.rB] = regs[u->a.rA] < u->a.imm; NEXT();
+    HANDLER(UOP_ADD_LW) DO_ADD(u->a); regs[0] = 0; DO_LW(u->b, u->offset + 1); NEXT();
+    HANDLER(UOP_ADDI_JEQ) {
+        DO_ADDI(u->a);
+        regs[0] = 0;
+        uint16_t offset = u->offset + 1;
+        uint16_t this_pc = pc + offset;
+        uint16_t new_pc = JEQ_TARGET(u->b, offset);
+        if ((this_pc & 8191) == new_pc) { pc = this_pc; return; }
+        pc = new_pc;
+        ENTER();
+    }
+    HANDLER(UOP_EXIT) pc += u->offset; ENTER();
+
+#ifndef E20_COMPUTED_GOTO
+        }
+    }
+#endif
+#undef HANDLER
+#undef DISPATCH
+#undef ENTER
+#undef NEXT
+#undef JUMP
+#undef DO_ADD
+#undef DO_ADDI
+#undef DO_LW
+#undef JEQ_TARGET
+}
+
+
+/*
+    Runs the loaded program to completion on the execution core
+    selected with --core.
+*/
+void run_core(const string& core, uint16_t& pc, uint16_t regs[], uint16_t mem[], DecodedIns decoded[],
+              Cache& L1, Cache& L2) {
+    uint64_t budget = NO_LIMIT;
+    if (core == "threaded")
+        sim_threaded(pc, regs, mem, decoded, L1, L2);
+    else if (core == "block")
+        sim_blocks(pc, regs, mem, decoded, L1, L2);
+    else if (core == "jit") {
+#ifdef E20_JIT
+        Jit jit;
+        if (jit.available()) {
+            sim_blocks(pc, regs, mem, decoded, L1, L2, &jit);
+            return;
+        }
+#endif
+        cerr << "JIT not available, using the block core" << endl;
+        sim_blocks(pc, regs, mem, decoded, L1, L2);
+    }
+    else
+        sim(pc, regs, mem, decoded, L1, L2, budget);
+}
+
+/*
+    Runs the loaded program until it halts or has run budget instructions.
+    Only the reference loop core can stop at an exact instruction, so a
+    limited run always uses it, whatever core is selected.
+
+    @param budget The most instructions to run, or NO_LIMIT. Reduced by
+        the number run, unless it is NO_LIMIT
+
+    @return Whether the program halted
+*/
+bool run_core(const string& core, uint16_t& pc, uint16_t regs[], uint16_t mem[], DecodedIns decoded[],
+              Cache& L1, Cache& L2, uint64_t& budget) {
+    if (budget != NO_LIMIT) return sim(pc, regs, mem, decoded, L1, L2, budget);
+    run_core(core, pc, regs, mem, decoded, L1, L2);
+    return true;
+}
+
+/*
+    Runs the program for budget instructions, or until it halts, without
+    simulating the caches. Its accesses go to a dummy instead.
+
+    @param warm Whether to still update the contents of L1 and L2 with the
+        accesses, so that they aren't stale when simulation resumes. They
+        are neither logged nor counted
+
+    @param log Where L1 and L2 log their accesses afterwards, or nullptr
+
+    @param budget The most instructions to run. Reduced by the number run
+
+    @return Whether the program halted
+*/
+bool fast_forward(uint16_t& pc, uint16_t regs[], uint16_t mem[], DecodedIns decoded[], Cache& L1, Cache& L2,
+                  bool warm, LogWriter* log, uint64_t& budget) {
+    if (!warm) {
+        Cache none = Cache("dummy", 0, 0, 0, nullptr);
+        return sim(pc, regs, mem, decoded, none, none, budget);
+    }
+
+    CacheStats counted[2] = {L1.stats(), L2.stats()};
+    L1.stopLogging();
+    L2.stopLogging();
+    bool halted = sim(pc, regs, mem, decoded, L1, L2, budget);
+    L1.restoreStats(counted[0]);
+    L2.restoreStats(counted[1]);
+    if (log != nullptr) {
+        if (L1.present()) L1.logTo(log);
+        if (L2.present()) L2.logTo(log);
+    }
+    return halted;
+}
+
+/*
+    Estimates a ratio sum(y) / sum(x) from paired samples, and the half
+    width of its 95% confidence interval, by the usual linearization of a
+    ratio estimator. The interval is negative if there are too few samples
+    to have one.
+*/
+void estimate_ratio(const vector<double>& y, const vector<double>& x, double& ratio, double& interval) {
+    double sum_y = 0, sum_x = 0;
+    for (size_t i = 0; i < y.size(); i++) {
+        sum_y += y[i];
+        sum_x += x[i];
+    }
+    ratio = sum_x == 0 ? 0.0 : sum_y / sum_x;
+    interval = -1.0;
+    size_t n = y.size();
+    if (n < 2 || sum_x == 0) return;
+
+    double variance = 0;
+    for (size_t i = 0; i < n; i++) variance += (y[i] - ratio * x[i]) * (y[i] - ratio * x[i]);
+    variance /= n - 1;
+    interval = 1.96 * sqrt(variance / n) / (sum_x / n);
+}
+
+/*
+    Prints one cache's extrapolated counters, as one line.
+
+    @param samples The cache's counters over each sampled window
+
+    @param window_instructions The instructions run in each window
+
+    @param instructions All instructions run while sampling
+*/
+void print_sample_estimate(LogWriter& log, const string& cache_name, const vector<CacheStats>& samples,
+                           const vector<double>& window_instructions, uint64_t instructions) {
+    vector<double> accesses, loads, misses;
+    for (const CacheStats& sample : samples) {
+        accesses.push_back(sample.accesses());
+        loads.push_back(sample.loads());
+        misses.push_back(sample.count(AccessResult::MISS));
+    }
+    double per_instruction, per_instruction_interval, miss_ratio, miss_interval;
+    estimate_ratio(accesses, window_instructions, per_instruction, per_instruction_interval);
+    estimate_ratio(misses, loads, miss_ratio, miss_interval);
+
+    char text[96];
+    log.text("Cache ");
+    log.text(cache_name);
+    log.text(" estimate: accesses ");
+    log.number(llround(per_instruction * instructions));
+    if (per_instruction_interval >= 0) {
+        log.text(" +/- ");
+        log.number(llround(per_instruction_interval * instructions));
+    }
+    snprintf(text, sizeof(text), ", miss rate %.2f%%", 100.0 * miss_ratio);
+    log.text(text);
+    if (miss_interval >= 0) {
+        snprintf(text, sizeof(text), " +/- %.2f%%", 100.0 * miss_interval);
+        log.text(text);
+    }
+    log.put('\n');
+}
+
+/*
+    Runs the program to completion, simulating the caches in detail only
+    for the last window instructions of every period, and fast-forwarding
+    through the rest. Then prints the counters of each cache extrapolated
+    from those windows to the whole run, with 95% confidence intervals.
+
+    @param warm Whether fast-forwarding still updates the caches' contents
+
+    @param log Where to print the estimates. Accesses aren't logged
+*/
+void run_sampled(uint16_t& pc, uint16_t regs[], uint16_t mem[], DecodedIns decoded[], Cache& L1, Cache& L2,
+                 uint64_t period, uint64_t window, bool warm, LogWriter& log) {
+    L1.stopLogging();
+    L2.stopLogging();
+
+    vector<CacheStats> samples[2];
+    vector<double> window_instructions;
+    uint64_t instructions = 0, detailed = 0;
+    bool halted = false;
+    while (!halted) {
+        uint64_t budget = period - window;
+        halted = fast_forward(pc, regs, mem, decoded, L1, L2, warm, nullptr, budget);
+        instructions += period - window - budget;
+        if (halted) break;
+
+        CacheStats start[2] = {L1.stats(), L2.stats()};
+        budget = window;
+        halted = sim(pc, regs, mem, decoded, L1, L2, budget);
+        instructions += window - budget;
+        detailed += window - budget;
+        samples[0].push_back(L1.stats().since(start[0]));
+        samples[1].push_back(L2.stats().since(start[1]));
+        window_instructions.push_back(window - budget);
+    }
+
+    log.text("Sampled ");
+    log.number(detailed);
+    log.text(" of ");
+    log.number(instructions);
+    log.text(" instructions in ");
+    log.number(window_instructions.size());
+    log.text(" windows");
+    log.put('\n');
+    print_sample_estimate(log, L1.getName(), samples[0], window_instructions, instructions);
+    if (L2.present()) print_sample_estimate(log, L2.getName(), samples[1], window_instructions, instructions);
+}
+
+/*
+    One iteration of a loop, worked out symbolically from the path it took:
+    what each register ends up as, which branches must go the same way
+    again, and which addresses it accesses, all in terms of the registers
+    at the start of the iteration. When every register either steps by a
+    constant, is recomputed from those that do, or sums something computed
+    from them, any later iteration can be evaluated directly, without
+    running the ones before it.
+*/
+class LoopModel {
+public:
+    // The longest loop body that is considered
+    static constexpr size_t MAX_PATH = 256;
+    // The most iterations skipped at once
+    static constexpr uint64_t MAX_ITERATIONS = 1 << 24;
+    // Values that take longer than this to evaluate aren't worth skipping with
+    static constexpr uint32_t MAX_COST = 64;
+
+    /*
+        Works out the iteration that just ran.
+
+        @param path The pc of each instruction run, starting at the loop
+            head, which the last one returned to
+
+        @return Whether every iteration that takes the same path can be
+            evaluated directly
+    */
+    bool analyze(const vector<uint16_t>& path, const DecodedIns decoded[]) {
+        int reg[NUM_REGS];
+        reg[0] = constant(0);
+        for (size_t r = 1; r < NUM_REGS; r++) {
+            Value start;
+            start.coef[r] = 1;
+            start.refs = 1 << r;
+            reg[r] = add(start);
+        }
+
+        bool loads = false;
+        for (size_t i = 0; i < path.size(); i++) {
+            uint16_t at = path[i];
+            uint16_t next = path[(i + 1) % path.size()];
+            const DecodedIns& ins = decoded[at & 8191];
+            bool jumps = false;
+
+            if (ins.op == OP_ADD) reg[ins.rC] = combine(Value::ADD, reg[ins.rA], reg[ins.rB]);
+            else if (ins.op == OP_SUB) reg[ins.rC] = combine(Value::SUB, reg[ins.rA], reg[ins.rB]);
+            else if (ins.op == OP_OR) reg[ins.rC] = combine(Value::OR, reg[ins.rA], reg[ins.rB]);
+            else if (ins.op == OP_AND) reg[ins.rC] = combine(Value::AND, reg[ins.rA], reg[ins.rB]);
+            else if (ins.op == OP_SLT) reg[ins.rC] = combine(Value::SLT, reg[ins.rA], reg[ins.rB]);
+            else if (ins.op == OP_SLTI) reg[ins.rB] = combine(Value::SLT, reg[ins.rA], constant(ins.imm));
+            else if (ins.op == OP_ADDI) reg[ins.rB] = combine(Value::ADD, reg[ins.rA], constant(ins.imm));
+            else if (ins.op == OP_LW || ins.op == OP_SW) {
+                int address = combine(Value::ADD, reg[ins.rA], constant(ins.imm));
+                accesses.push_back(address);
+                if (ins.op == OP_LW) {
+                    Value load;
+                    load.kind = Value::LOAD;
+                    load.a = address;
+                    load.refs = values[address].refs;
+                    load.cost = values[address].cost + 1;
+                    reg[ins.rB] = add(load);
+                    loads = true;
+                } else {
+                    stores.push_back(Store{address, reg[ins.rB]});
+                }
+            } else if (ins.op == OP_JR) {
+                jumps = true;
+                guards.push_back(Guard{reg[ins.rA], constant(next), true});
+            } else if (ins.op == OP_J || ins.op == OP_JAL) {
+                jumps = true;
+                if (ins.imm != next) return false;
+                if (ins.op == OP_JAL) reg[7] = constant(at + 1);
+            } else if (ins.op == OP_JEQ) {
+                jumps = true;
+                uint16_t target = at + 1 + ins.imm;
+                if (target == next && next != (uint16_t)(at + 1))
+                    guards.push_back(Guard{reg[ins.rA], reg[ins.rB], true});
+                else if (target != next && next == (uint16_t)(at + 1))
+                    guards.push_back(Guard{reg[ins.rA], reg[ins.rB], false});
+                else if (target != next)
+                    return false;
+            }
+
+            // A jump to itself is a halt, and anything else must fall through to the next instruction
+            if (jumps ? (at & 8191) == next : (uint16_t)(at + 1) != next) return false;
+            reg[0] = constant(0);
+        }
+        // A store could change what a load reads in a later iteration
+        if (loads && !stores.empty()) return false;
+
+        // Registers that step by a constant are the ones everything else is evaluated from
+        uint8_t stepping = 0;
+        for (size_t r = 1; r < NUM_REGS; r++) {
+            const Value& end = values[reg[r]];
+            if (end.kind == Value::AFFINE && end.refs == (1 << r) && end.coef[r] == 1) {
+                stepping |= 1 << r;
+                step[r] = end.c;
+            }
+        }
+        for (size_t r = 1; r < NUM_REGS; r++) {
+            if (stepping & (1 << r)) {
+                kind[r] = STEPS;
+                continue;
+            }
+            // A sum is the register itself plus a term, which may be affine or not
+            const Value& end = values[reg[r]];
+            kind[r] = REPLACED;
+            term[r] = reg[r];
+            if (end.kind == Value::AFFINE && end.coef[r] == 1) {
+                Value rest = end;
+                rest.coef[r] = 0;
+                rest.refs &= ~(1 << r);
+                kind[r] = SUMS;
+                term[r] = add(rest);
+            } else if (end.kind == Value::ADD) {
+                for (int side = 0; side < 2; side++) {
+                    const Value& own = values[side == 0 ? end.a : end.b];
+                    if (own.kind == Value::AFFINE && own.refs == (1 << r) && own.coef[r] == 1) {
+                        kind[r] = SUMS;
+                        int other = side == 0 ? end.b : end.a;
+                        term[r] = own.c == 0 ? other : combine(Value::ADD, other, constant(own.c));
+                    }
+                }
+            }
+            if ((values[term[r]].refs & ~stepping) || values[term[r]].cost > MAX_COST) return false;
+        }
+        for (const Guard& guard : guards)
+            if (((values[guard.x].refs | values[guard.y].refs) & ~stepping) ||
+                values[guard.x].cost + values[guard.y].cost > MAX_COST)
+                return false;
+        for (const Store& store : stores)
+            if (((values[store.address].refs | values[store.value].refs) & ~stepping) ||
+                values[store.address].cost + values[store.value].cost > MAX_COST)
+                return false;
+
+        // The caches can only be extrapolated if every access moves by the same stride each iteration
+        for (size_t i = 0; i < accesses.size(); i++) {
+            const Value& address = values[accesses[i]];
+            if (address.kind != Value::AFFINE || (address.refs & ~stepping)) return false;
+            uint16_t moves = affineStep(address) & 8191;
+            if (i > 0 && moves != stride) return false;
+            stride = moves;
+        }
+
+        body = vector<bool>(MEM_SIZE);
+        for (uint16_t at : path) body[at & 8191] = true;
+        return true;
+    }
+
+    /*
+        Counts the iterations, starting with the one about to run, that
+        take the same path, up to MAX_ITERATIONS.
+
+        @param start The registers at the loop head
+    */
+    uint64_t iterations(const uint16_t start[], const uint16_t mem[]) const {
+        uint64_t count = MAX_ITERATIONS;
+        // Branches on values that step have a closed form; others are tried one iteration at a time
+        vector<const Guard*> scanned;
+        for (const Guard& guard : guards) {
+            const Value& x = values[guard.x];
+            const Value& y = values[guard.y];
+            if (x.kind == Value::AFFINE && y.kind == Value::AFFINE)
+                count = min(count, equalFor(affineBase(x, start) - affineBase(y, start),
+                                            affineStep(x) - affineStep(y), guard.equal));
+            else
+                scanned.push_back(&guard);
+        }
+        for (uint64_t k = 0; k < count && (!scanned.empty() || !stores.empty()); k++) {
+            for (const Guard* guard : scanned)
+                if ((evaluate(guard->x, k, start, mem) == evaluate(guard->y, k, start, mem)) != guard->equal)
+                    return k;
+            // Stopping short of a store into the loop itself, which could change its path
+            for (const Store& store : stores)
+                if (body[evaluate(store.address, k, start, mem) & 8191]) return k;
+        }
+        return count;
+    }
+
+    /*
+        The number of iterations after which every access has moved by a
+        whole number of spans of each cache, so that they map onto the
+        same rows again. 0 if there's no such number.
+    */
+    uint64_t period(const Cache& L1, const Cache& L2) const {
+        uint64_t iterations = 1;
+        if (accesses.empty()) return iterations;
+        for (const Cache* cache : {&L1, &L2}) {
+            if (!cache->present()) continue;
+            // translate() wraps around memory, which only keeps rows if the span divides it
+            uint64_t span = MEM_SIZE % cache->span() == 0 ? cache->span() : MEM_SIZE;
+            iterations = max(iterations, span / gcd<uint64_t>(stride, span));
+        }
+        return iterations;
+    }
+
+    // The words every access moves by in one iteration, modulo MEM_SIZE
+    uint16_t strideWords() const { return stride; }
+
+    /*
+        Carries the machine forward by count iterations of the loop, which
+        must all take the same path, without running them. The caches are
+        left alone.
+    */
+    void advance(uint64_t count, uint16_t regs[], uint16_t mem[], DecodedIns decoded[]) const {
+        for (uint64_t k = 0; k < count && !stores.empty(); k++) {
+            for (const Store& store : stores) {
+                uint16_t addr = evaluate(store.address, k, regs, mem) & 8191;
+                mem[addr] = evaluate(store.value, k, regs, mem);
+                decoded[addr] = decode(mem[addr]);
+            }
+        }
+
+        uint16_t end[NUM_REGS] = {0};
+        for (size_t r = 1; r < NUM_REGS; r++) {
+            if (kind[r] == STEPS) {
+                end[r] = regs[r] + times(count, step[r]);
+            } else if (kind[r] == REPLACED) {
+                end[r] = count == 0 ? regs[r] : evaluate(term[r], count - 1, regs, mem);
+            } else {
+                uint16_t sum = regs[r];
+                const Value& added = values[term[r]];
+                if (added.kind == Value::AFFINE) {
+                    // count * base + step * (0 + 1 + ... + count - 1)
+                    sum += times(count, affineBase(added, regs)) + times(count * (count - 1) / 2, affineStep(added));
+                } else if (added.kind == Value::LOAD && values[added.a].kind == Value::AFFINE) {
+                    // Summing an array, the common case, walks memory directly
+                    uint16_t addr = affineBase(values[added.a], regs);
+                    uint16_t moves = affineStep(values[added.a]);
+                    for (uint64_t k = 0; k < count; k++, addr += moves) sum += mem[addr & 8191];
+                } else {
+                    for (uint64_t k = 0; k < count; k++) sum += evaluate(term[r], k, regs, mem);
+                }
+                end[r] = sum;
+            }
+        }
+        copy(end, end + NUM_REGS, regs);
+    }
+
+private:
+    /*
+        AFFINE is c plus the sum of coef[r] times register r at the start
+        of the iteration. The other kinds apply an operation to values a
+        and b, or load from the address in value a.
+    */
+    struct Value {
+        enum Kind { AFFINE, ADD, SUB, OR, AND, SLT, LOAD } kind = AFFINE;
+        uint16_t coef[NUM_REGS] = {0};
+        uint16_t c = 0;
+        int a = 0, b = 0;
+        uint8_t refs = 0; // bit r is set if the value depends on register r at the start
+        uint32_t cost = 1; // how many values evaluating it visits
+    };
+
+    struct Guard {
+        int x, y;
+        bool equal; // whether x and y must be equal for the branch to go the same way
+    };
+
+    struct Store {
+        int address, value;
+    };
+
+    // How a register gets its value at the end of an iteration
+    enum RegisterKind { STEPS, REPLACED, SUMS };
+
+    int add(const Value& value) {
+        values.push_back(value);
+        return values.size() - 1;
+    }
+
+    int constant(uint16_t c) {
+        Value value;
+        value.c = c;
+        return add(value);
+    }
+
+    // Keeps sums and differences of affine values affine, and folds constants
+    int combine(Value::Kind kind, int a, int b) {
+        const Value& x = values[a];
+        const Value& y = values[b];
+        bool affine = x.kind == Value::AFFINE && y.kind == Value::AFFINE;
+        if (affine && (kind == Value::ADD || kind == Value::SUB)) {
+            Value sum = x;
+            for (size_t r = 0; r < NUM_REGS; r++) sum.coef[r] = kind == Value::ADD ? x.coef[r] + y.coef[r] : x.coef[r] - y.coef[r];
+            sum.c = kind == Value::ADD ? x.c + y.c : x.c - y.c;
+            sum.refs = 0;
+            for (size_t r = 0; r < NUM_REGS; r++)
+                if (sum.coef[r] != 0) sum.refs |= 1 << r;
+            return add(sum);
+        }
+        if (affine && x.refs == 0 && y.refs == 0) {
+            if (kind == Value::OR) return constant(x.c | y.c);
+            if (kind == Value::AND) return constant(x.c & y.c);
+            if (kind == Value::SLT) return constant(x.c < y.c ? 1 : 0);
+        }
+        Value value;
+        value.kind = kind;
+        value.a = a;
+        value.b = b;
+        value.refs = x.refs | y.refs;
+        value.cost = min<uint32_t>(x.cost + y.cost + 1, MAX_COST + 1);
+        return add(value);
+    }
+
+    // A product modulo 2^16, as the machine's arithmetic wraps
+    static uint16_t times(uint64_t a, uint64_t b) { return (uint16_t)(a * b); }
+
+    uint16_t affineBase(const Value& value, const uint16_t start[]) const {
+        uint16_t base = value.c;
+        for (size_t r = 1; r < NUM_REGS; r++) base += times(value.coef[r], start[r]);
+        return base;
+    }
+
+    // How much an affine value changes from one iteration to the next
+    uint16_t affineStep(const Value& value) const {
+        uint16_t moves = 0;
+        for (size_t r = 1; r < NUM_REGS; r++) moves += times(value.coef[r], step[r]);
+        return moves;
+    }
+
+    // The value in iteration k, counting the one about to run as 0
+    uint16_t evaluate(int index, uint64_t k, const uint16_t start[], const uint16_t mem[]) const {
+        const Value& value = values[index];
+        switch (value.kind) {
+        case Value::AFFINE: return affineBase(value, start) + times(k, affineStep(value));
+        case Value::ADD: return evaluate(value.a, k, start, mem) + evaluate(value.b, k, start, mem);
+        case Value::SUB: return evaluate(value.a, k, start, mem) - evaluate(value.b, k, start, mem);
+        case Value::OR: return evaluate(value.a, k, start, mem) | evaluate(value.b, k, start, mem);
+        case Value::AND: return evaluate(value.a, k, start, mem) & evaluate(value.b, k, start, mem);
+        case Value::SLT: return evaluate(value.a, k, start, mem) < evaluate(value.b, k, start, mem) ? 1 : 0;
+        default: return mem[evaluate(value.a, k, start, mem) & 8191];
+        }
+    }
+
+    /*
+        Counts the iterations for which a difference base + k * moves,
+        modulo 2^16, keeps being zero (if equal) or nonzero.
+    */
+    static uint64_t equalFor(uint16_t base, uint16_t moves, bool equal) {
+        if (equal) return base != 0 ? 0 : moves == 0 ? MAX_ITERATIONS : 1;
+        if (base == 0) return 0;
+        if (moves == 0) return MAX_ITERATIONS;
+        // Solve base + k * moves == 0: moves is a power of two g times an odd number
+        uint32_t g = moves & -moves;
+        uint16_t needed = -base;
+        if (needed % g != 0) return MAX_ITERATIONS;
+        uint16_t odd = moves / g, inverse = odd;
+        for (int i = 0; i < 4; i++) inverse = times(inverse, 2 - times(odd, inverse));
+        uint32_t k = times(needed / g, inverse) % (65536 / g);
+        return min<uint64_t>(k, MAX_ITERATIONS);
+    }
+
+    vector<Value> values;
+    vector<Guard> guards;
+    vector<int> accesses; // the address of each LW and SW, in order
+    vector<Store> stores;
+    vector<bool> body; // the instructions of the loop
+    RegisterKind kind[NUM_REGS];
+    uint16_t step[NUM_REGS] = {0};
+    int term[NUM_REGS] = {0};
+    uint16_t stride = 0;
+};
+
+/*
+    At the head of a loop, runs one iteration to learn its path, and if
+    later iterations can be evaluated directly, runs whole iterations in
+    detail until the caches repeat themselves from one period to the next,
+    moved along by the loop's stride. Then skips as many periods as the
+    loop keeps its path for, adding each period's counters to the caches
+    once per period skipped. The rest of the loop is left to run as usual.
+
+    @param halted Set if the program halted
+
+    @return Whether any iterations were skipped
+*/
+bool skip_loop(uint16_t& pc, uint16_t regs[], uint16_t mem[], DecodedIns decoded[], Cache& L1, Cache& L2,
+               bool& halted) {
+    uint16_t head = pc;
+    vector<uint16_t> path;
+    do {
+        path.push_back(pc);
+        uint64_t budget = 1;
+        halted = sim(pc, regs, mem, decoded, L1, L2, budget);
+        if (halted) return false;
+    } while (pc != head && path.size() < LoopModel::MAX_PATH);
+    if (pc != head) return false;
+
+    LoopModel loop;
+    if (!loop.analyze(path, decoded)) return false;
+    uint64_t remaining = loop.iterations(regs, mem);
+    uint64_t period = loop.period(L1, L2);
+
+    while (remaining >= 2 * period) {
+        Cache before[2] = {L1, L2};
+        uint64_t budget = period * path.size();
+        halted = sim(pc, regs, mem, decoded, L1, L2, budget);
+        if (halted) return false;
+        remaining -= period;
+
+        uint64_t moved = (uint64_t)loop.strideWords() * period;
+        before[0].translate(moved);
+        before[1].translate(moved);
+        if (!before[0].sameContents(L1) || !before[1].sameContents(L2)) continue;
+
+        // From here on, every period does to the caches what the last one did
+        uint64_t periods = remaining / period;
+        loop.advance(periods * period, regs, mem, decoded);
+        Cache* levels[2] = {&L1, &L2};
+        for (int level = 0; level < 2; level++) {
+            CacheStats added = levels[level]->stats().since(before[level].stats());
+            for (int i = 0; i < 3; i++) added.results[i] *= periods;
+            levels[level]->addStats(added);
+            levels[level]->translate(moved * periods);
+        }
+        return true;
+    }
+    return false;
+}
+
+/*
+    Runs the program to completion like sim(), but skips ahead through
+    loops once their cache behavior repeats, as in skip_loop(). The caches'
+    counters and the machine end up exactly as if every iteration had been
+    simulated. Accesses must not be logged or traced, since skipped ones
+    never reach the caches.
+*/
+void run_steady(uint16_t& pc, uint16_t regs[], uint16_t mem[], DecodedIns decoded[], Cache& L1, Cache& L2) {
+    const uint64_t CHUNK = 4096;
+
+    // Loop heads are the targets of backward jumps
+    vector<bool> head(MEM_SIZE);
+    for (size_t addr = 0; addr < MEM_SIZE; addr++) {
+        const DecodedIns& ins = decoded[addr];
+        if (ins.op == OP_J && ins.imm <= addr) head[ins.imm] = true;
+        if (ins.op == OP_JEQ && ((addr + 1 + ins.imm) & 0xFFFF) <= addr) head[(addr + 1 + ins.imm) & 0xFFFF] = true;
+    }
+
+    // A loop that can't be skipped is tried again less and less often
+    vector<uint32_t> failures(MEM_SIZE);
+    vector<uint64_t> next_try(MEM_SIZE);
+    for (uint64_t chunk = 0;; chunk++) {
+        uint64_t budget = CHUNK;
+        if (sim(pc, regs, mem, decoded, L1, L2, budget)) return;
+
+        for (size_t i = 0; i < LoopModel::MAX_PATH && !head[pc & 8191]; i++) {
+            budget = 1;
+            if (sim(pc, regs, mem, decoded, L1, L2, budget)) return;
+        }
+        size_t at = pc & 8191;
+        if (!head[at] || next_try[at] > chunk) continue;
 
-    @param blocksize The blocksize of the cache. One of [1,2,4,8,16,32,64]
+        bool halted;
+        if (skip_loop(pc, regs, mem, decoded, L1, L2, halted)) {
+            failures[at] = 0;
+        } else {
+            failures[at] = min<uint32_t>(failures[at] + 1, 16);
+            next_try[at] = chunk + (1u << failures[at]);
+        }
+        if (halted) return;
+    }
+}
 
-    @param num_rows The number of rows in the given cache.
+
+/*
+    Splits a --cache string into its numbers. Throws if one of them isn't
+    a number.
 */
-void print_cache_config(const string& cache_name, int size, int assoc, int blocksize, int num_rows) {
-    cout << "Cache " << cache_name << " has size " << size <<
-         ", associativity " << assoc << ", blocksize " << blocksize <<
-         ", rows " << num_rows << endl;
+vector<int> split_cache_config(const string& cache_config) {
+    vector<int> parts;
+    size_t pos;
+    size_t lastpos = 0;
+    while ((pos = cache_config.find(",", lastpos)) != string::npos) {
+        parts.push_back(stoi(cache_config.substr(lastpos, pos)));
+        lastpos = pos + 1;
+    }
+    parts.push_back(stoi(cache_config.substr(lastpos)));
+    return parts;
 }
 
 /*
-    Prints out a correctly-formatted log entry.
-
-    @param cache_name The name of the cache where the event
-        occurred. "L1" or "L2"
-
-    @param status The kind of cache event. "SW", "HIT", or
-        "MISS"
+    Whether cache_config is a one- or two-level --cache string with an
+    associativity of 1 to Cache::MAX_ASSOC and at least one row per level
+*/
+bool valid_cache_config(const string& cache_config) {
+    try {
+        vector<int> parts = split_cache_config(cache_config);
+        if (parts.size() != 3 && parts.size() != 6) return false;
+        for (size_t level = 0; level < parts.size(); level += 3) {
+            int size = parts[level], assoc = parts[level + 1], block_size = parts[level + 2];
+            if (assoc < 1 || assoc > Cache::MAX_ASSOC || block_size < 1 || size / ((int64_t)assoc * block_size) < 1)
+                return false;
+        }
+        return true;
+    } catch (const exception&) {
+        return false;
+    }
+}
 
-    @param pc The program counter of the memory
-        access instruction
+/*
+    Expands the argument of --sweep into a list of --cache strings.
 
-    @param addr The memory address being accessed.
+    Configurations are separated by ';' or whitespace, and "@file" reads
+    them from a file instead. Any field may list alternatives separated by
+    '/', which expands to every combination: "16/32,1/2,4" is four
+    configurations.
 
-    @param row The cache row or set number where the data
-        is stored.
+    @return false, with bad set to the offending configuration, if any of
+        them is not a valid one- or two-level configuration
 */
-void print_log_entry(const string& cache_name, const string& status, int pc, int addr, int row) {
-    cout << left << setw(8) << cache_name + " " + status << right <<
-         " pc:" << setw(5) << pc <<
-         "\taddr:" << setw(5) << addr <<
-         "\trow:" << setw(4) << row << endl;
-}
+bool expand_sweep(const string& spec, vector<string>& configs, string& bad) {
+    string text = spec;
+    if (!spec.empty() && spec[0] == '@') {
+        ifstream f(spec.substr(1));
+        if (!f.is_open()) {
+            bad = spec;
+            return false;
+        }
+        text.assign(istreambuf_iterator<char>(f), istreambuf_iterator<char>());
+    }
+    replace(text.begin(), text.end(), ';', ' ');
 
-void load_machine_code(ifstream& f, uint16_t mem[]) {
-    regex machine_code_re("^ram\\[(\\d+)\\] = 16'b(\\d+);.*$");
-    size_t expectedaddr = 0;
-    string line;
-    while (getline(f, line)) {
-        smatch sm;
-        if (!regex_match(line, sm, machine_code_re)) {
-            cerr << "Can't parse line: " << line << endl;
-            exit(1);
-        }
-        size_t addr = stoi(sm[1], nullptr, 10);
-        unsigned instr = stoi(sm[2], nullptr, 2);
-        if (addr != expectedaddr) {
-            cerr << "Memory addresses encountered out of sequence: " << addr << endl;
-            exit(1);
+    istringstream entries(text);
+    string entry;
+    while (entries >> entry) {
+        vector<string> expanded(1);
+        size_t start = 0;
+        while (true) {
+            size_t end = entry.find(',', start);
+            string field = entry.substr(start, end == string::npos ? string::npos : end - start);
+            vector<string> next;
+            for (const string& prefix : expanded) {
+                size_t a = 0;
+                while (true) {
+                    size_t b = field.find('/', a);
+                    next.push_back(prefix + (start == 0 ? "" : ",") + field.substr(a, b == string::npos ? string::npos : b - a));
+                    if (b == string::npos) break;
+                    a = b + 1;
+                }
+            }
+            expanded.swap(next);
+            if (end == string::npos) break;
+            start = end + 1;
         }
-        if (addr >= MEM_SIZE) {
-            cerr << "Program too big for memory" << endl;
-            exit(1);
+
+        for (const string& config : expanded) {
+            if (!valid_cache_config(config)) {
+                bad = config;
+                return false;
+            }
+            configs.push_back(config);
         }
-        expectedaddr++;
-        mem[addr] = instr;
     }
+    return true;
 }
 
+// Writes s into a column of the given width, padding on the left or right
+void print_column(LogWriter& log, const string& s, size_t width, bool left_align) {
+    if (left_align) log.text(s);
+    for (size_t i = s.size(); i < width; i++) log.put(' ');
+    if (!left_align) log.text(s);
+}
 
-class Cache {
+/*
+    LRU stacks of every row, cut off at Cache::MAX_ASSOC entries. That is
+    deep enough to tell, for each load, which associativities up to
+    MAX_ASSOC it hits in, so all of them are simulated at once.
+
+    As in Cache::writeCache, a store pushes a new copy of its block and
+    leaves the old one as a dead entry that still takes up its place.
+*/
+class TruncatedLruStacks {
 public:
-    Cache(const string& c_name, int c_size, int c_assoc, int c_block_size) {
-        name = c_name;
+    static constexpr uint16_t DEAD = 0xFFFF;
 
-        if (c_name != "dummy") {
-            int num_rows = c_size / (c_assoc * c_block_size);
-            print_cache_config(c_name, c_size, c_assoc, c_block_size, num_rows);
-            block_size = c_block_size;
-            vector<int> block(c_assoc, -1);
-            rows = vector<vector<int> >(num_rows, block);
+    TruncatedLruStacks(int rows, int block_size)
+        : rows(rows), block_size(block_size), stacks((size_t)rows * Cache::MAX_ASSOC, DEAD), depth(rows, 0),
+          find_block(select_tag_search(Cache::MAX_ASSOC)) {}
+
+    void access(uint32_t rec) {
+        uint16_t block_id = trace_addr(rec) / block_size;
+        int r = block_id % rows;
+        uint16_t* stack = &stacks[(size_t)r * Cache::MAX_ASSOC];
+        int n = depth[r];
+        // Unused entries are DEAD, so a block is only ever found above n
+        int pos = find_block(stack, Cache::MAX_ASSOC, block_id);
+        if (pos < 0) pos = n;
+
+        if (trace_op(rec) == AccessOp::LW) {
+            loads++;
+            if (pos < n) hits_at[pos]++;
+        } else {
+            stores++;
+            if (pos < n) stack[pos] = DEAD;
+            pos = n;
+        }
+        // Move the block to the top, pushing everything above its old place down one
+        if (pos == n) {
+            if (n < Cache::MAX_ASSOC) depth[r]++;
+            else pos--;
         }
+        for (; pos > 0; pos--) stack[pos] = stack[pos - 1];
+        stack[0] = block_id;
     }
 
-    void writeCache(vector<int>& curr_block, int new_tag) {
-        // shift all values down 1
-        for (size_t idx = curr_block.size() - 1; idx > 0; idx--) {
-            curr_block[idx] = curr_block[idx - 1];
-        }
-        curr_block[0] = new_tag;
+    // LW misses of the cache with this many ways
+    uint64_t misses(int assoc) const {
+        uint64_t hits = 0;
+        for (int d = 0; d < assoc; d++) hits += hits_at[d];
+        return loads - hits;
+    }
+
+    uint64_t loads = 0;
+    uint64_t stores = 0;
+
+private:
+    int rows;
+    int block_size;
+    vector<uint16_t> stacks;
+    vector<int> depth;
+    TagSearch find_block;
+    uint64_t hits_at[Cache::MAX_ASSOC] = {};
+};
+
+/*
+    Runs one access stream through many cache configurations at once, on a
+    pool of threads, and prints a table with one row of counters per
+    configuration.
+
+    Two-level configurations each get their own hierarchy. Single-level
+    ones are batched by block size: all of a batch's configurations with
+    the same number of rows share one set of LRU stacks, since an LRU
+    cache's contents are always the top of its rows' stacks, and each
+    access is looked up in a stack with vector compares.
+
+    @param records The access stream, as captured by a TraceWriter
+
+    @param configs Valid --cache strings, as produced by expand_sweep
 
+    @param jobs The number of threads to use
+*/
+void run_sweep(const vector<uint32_t>& records, const vector<string>& configs, unsigned jobs, LogWriter& log) {
+    vector<CacheStats> results(configs.size() * 2);
+
+    // Each task is either every single-level configuration with some block size, or one two-level configuration
+    vector<vector<size_t>> tasks;
+    vector<int> batch_block_sizes;
+    vector<size_t> two_level;
+    for (size_t i = 0; i < configs.size(); i++) {
+        vector<int> parts = split_cache_config(configs[i]);
+        if (parts.size() == 6) {
+            two_level.push_back(i);
+            continue;
+        }
+        size_t batch = find(batch_block_sizes.begin(), batch_block_sizes.end(), parts[2]) - batch_block_sizes.begin();
+        if (batch == batch_block_sizes.size()) {
+            batch_block_sizes.push_back(parts[2]);
+            tasks.emplace_back();
+        }
+        tasks[batch].push_back(i);
     }
+    for (size_t i : two_level) tasks.push_back({i});
 
-    string handleLW(vector<int>& curr_block, int tag_query) const {
-        int target = -1;
-        for (int offset = 0; offset < curr_block.size(); offset++) {//try to find a hit
-            if (curr_block[offset] == tag_query) {
-                target = offset;
-                break;
+    auto run_batch = [&](const vector<size_t>& batch) {
+        vector<int> row_counts;
+        vector<TruncatedLruStacks> stacks;
+        vector<size_t> stack_of(batch.size());
+        for (size_t b = 0; b < batch.size(); b++) {
+            vector<int> parts = split_cache_config(configs[batch[b]]);
+            int rows = parts[0] / (parts[1] * parts[2]);
+            size_t k = find(row_counts.begin(), row_counts.end(), rows) - row_counts.begin();
+            if (k == row_counts.size()) {
+                row_counts.push_back(rows);
+                stacks.emplace_back(rows, parts[2]);
             }
+            stack_of[b] = k;
+        }
+        for (uint32_t rec : records) {
+            for (TruncatedLruStacks& level : stacks) level.access(rec);
         }
-        if (target > -1) { //handle hit
-            int temp = curr_block[target]; // hit value
+        for (size_t b = 0; b < batch.size(); b++) {
+            const TruncatedLruStacks& level = stacks[stack_of[b]];
+            uint64_t misses = level.misses(split_cache_config(configs[batch[b]])[1]);
+            CacheStats& stats = results[2 * batch[b]];
+            stats.results[static_cast<int>(AccessResult::HIT)] = level.loads - misses;
+            stats.results[static_cast<int>(AccessResult::MISS)] = misses;
+            stats.results[static_cast<int>(AccessResult::SW)] = level.stores;
+        }
+    };
 
-            for (int idx = target; idx > 0; idx--) {// Shift down elements to hit value in block
-                curr_block[idx] = curr_block[idx - 1];
+    atomic<size_t> next(0);
+    auto worker = [&]() {
+        for (size_t t; (t = next.fetch_add(1)) < tasks.size(); ) {
+            size_t i = tasks[t][0];
+            vector<int> parts = split_cache_config(configs[i]);
+            if (parts.size() == 3) {
+                run_batch(tasks[t]);
+                continue;
             }
+            Cache L1 = Cache("L1", parts[0], parts[1], parts[2], nullptr);
+            Cache L2 = Cache("L2", parts[3], parts[4], parts[5], nullptr);
+            replay_records(records, L1, L2);
+            results[2 * i] = L1.stats();
+            results[2 * i + 1] = L2.stats();
+        }
+    };
+    vector<thread> pool;
+    for (unsigned t = 1; t < jobs && t < tasks.size(); t++) pool.emplace_back(worker);
+    worker();
+    for (thread& t : pool) t.join();
 
-            curr_block[0] = temp; // move hit value to most recent position
-            return "HIT";
+    size_t config_width = 6;
+    for (const string& config : configs) config_width = max(config_width, config.size());
+    const size_t width = 13;
+    const char* const columns[] = {"accesses", "LW hits", "LW misses", "SW", "miss rate"};
+
+    print_column(log, "config", config_width, true);
+    for (const char* level : {"L1 ", "L2 "}) {
+        for (const char* column : columns) print_column(log, string(level) + column, width, false);
+    }
+    log.put('\n');
+
+    for (size_t i = 0; i < configs.size(); i++) {
+        print_column(log, configs[i], config_width, true);
+        for (int level = 0; level < 2; level++) {
+            const CacheStats& stats = results[2 * i + level];
+            if (level == 1 && split_cache_config(configs[i]).size() == 3) {
+                for (size_t c = 0; c < 5; c++) print_column(log, "-", width, false);
+                continue;
+            }
+            char rate[32];
+            snprintf(rate, sizeof(rate), "%.2f%%", stats.missRate());
+            log.put(' ');
+            log.number(stats.accesses(), width - 1);
+            log.put(' ');
+            log.number(stats.count(AccessResult::HIT), width - 1);
+            log.put(' ');
+            log.number(stats.count(AccessResult::MISS), width - 1);
+            log.put(' ');
+            log.number(stats.count(AccessResult::SW), width - 1);
+            print_column(log, rate, width, false);
         }
-        return "MISS";
+        log.put('\n');
     }
+}
 
-    const string& getName() const { return name; }
 
-    string access(const string& ins, int addr, uint16_t pc) {
-        string status = ins;
-        // Get Parameters
-        int block_id = addr / block_size;
-        int row_idx = (block_id % rows.size());
-        int tag_query = block_id / rows.size();
+// An access on its way from the L1 stage to the L2 stage of run_pipelined
+struct StagedAccess {
+    uint32_t rec;
+    AccessResult L1_status;
+};
 
-        // Index the relevant block
+/*
+    Runs the loaded program like run_core, with the caches simulated on
+    other threads. The program runs against absent caches and streams its
+    accesses to an L1 thread; with an L2, the L1 thread passes every access
+    and its L1 result on to an L2 thread. The last stage writes the log, so
+    it comes out in the usual order.
 
-        if (ins == "LW") status = handleLW(rows[row_idx], tag_query);
-        if (status != "HIT") writeCache(rows[row_idx], tag_query);
+    L1 and L2 must not log by themselves.
 
-        print_log_entry(name, status, pc, addr, row_idx);
-        return status;
+    @param log Where to print the log, or nullptr for none
+*/
+void run_pipelined(const string& core, uint16_t& pc, uint16_t regs[], uint16_t mem[], DecodedIns decoded[],
+                   Cache& L1, Cache& L2, LogWriter* log) {
+    SpscRing<uint32_t> to_L1;
+    SpscRing<StagedAccess> to_L2;
+    bool two_levels = L2.present();
+
+    auto log_L1 = [&](uint32_t rec, AccessResult status) {
+        int addr = trace_addr(rec);
+        if (log != nullptr) print_log_entry(*log, L1.getName(), result_name(status), trace_pc(rec), addr, L1.rowOf(addr));
+    };
+
+    thread L1_stage([&]() {
+        uint32_t batch[256];
+        size_t n;
+        while ((n = to_L1.pop(batch, 256)) > 0) {
+            for (size_t i = 0; i < n; i++) {
+                AccessResult status = L1.access(trace_op(batch[i]), trace_addr(batch[i]), trace_pc(batch[i]));
+                if (two_levels)
+                    to_L2.push(StagedAccess{batch[i], status});
+                else
+                    log_L1(batch[i], status);
+            }
+        }
+        to_L2.close();
+    });
+
+    thread L2_stage;
+    if (two_levels) {
+        L2_stage = thread([&]() {
+            StagedAccess batch[256];
+            size_t n;
+            while ((n = to_L2.pop(batch, 256)) > 0) {
+                for (size_t i = 0; i < n; i++) {
+                    uint32_t rec = batch[i].rec;
+                    int addr = trace_addr(rec);
+                    log_L1(rec, batch[i].L1_status);
+                    if (batch[i].L1_status == AccessResult::HIT) continue;
+                    AccessResult status = L2.access(trace_op(rec), addr, trace_pc(rec));
+                    if (log != nullptr) print_log_entry(*log, L2.getName(), result_name(status), trace_pc(rec), addr, L2.rowOf(addr));
+                }
+            }
+        });
     }
 
-private:
-    string name;
-    int block_size;
-    vector<vector<int> > rows;
-};
+    TraceWriter feed(to_L1);
+    Cache front = Cache("dummy", 0, 0, 0, nullptr);
+    Cache behind = Cache("dummy", 0, 0, 0, nullptr);
+    front.traceTo(&feed);
+    run_core(core, pc, regs, mem, decoded, front, behind);
+    to_L1.close();
+
+    L1_stage.join();
+    if (L2_stage.joinable()) L2_stage.join();
+}
+
+/*
+    Checkpoints, as written by --checkpoint: an 8-byte magic number, the
+    number of instructions run so far (64 bits), pc, the registers and all
+    of memory (16 bits each), the number of cache levels (8 bits), then
+    each level as written by Cache::saveState. Everything is little-endian.
+*/
+const char CHECKPOINT_MAGIC[8] = {'E', '2', '0', 'C', 'K', 'P', 'T', '1'};
+const size_t CHECKPOINT_MACHINE_SIZE = sizeof(CHECKPOINT_MAGIC) + 8 + 2 * (1 + NUM_REGS + MEM_SIZE) + 1;
 
+/*
+    Saves the whole state of a run, for --restore to carry on from.
 
-void sim(uint16_t& pc, uint16_t regs[], uint16_t mem[], Cache& L1, Cache& L2) {
+    @param instructions How many instructions have run so far
 
-    bool halt = false; //Set a flag for halt instruction
+    @return false if the file can't be written
+*/
+bool write_checkpoint(const char* path, uint64_t instructions, uint16_t pc, const uint16_t regs[],
+                      const uint16_t mem[], const Cache& L1, const Cache& L2) {
+    vector<unsigned char> bytes(CHECKPOINT_MAGIC, CHECKPOINT_MAGIC + sizeof(CHECKPOINT_MAGIC));
+    put_le(bytes, instructions, 8);
+    put_le(bytes, pc, 2);
+    for (size_t r = 0; r < NUM_REGS; r++) put_le(bytes, regs[r], 2);
+    for (size_t addr = 0; addr < MEM_SIZE; addr++) put_le(bytes, mem[addr], 2);
+    put_le(bytes, L1.present() + L2.present(), 1);
+    if (L1.present()) L1.saveState(bytes);
+    if (L2.present()) L2.saveState(bytes);
 
-    while (!halt) { //Continue to run until halt is flagged
-        //Access Memory at current Program Counter
-        uint16_t curr_ins = mem[pc & 8191]; //Read only 13 bits of pc
+    FILE* out = fopen(path, "wb");
+    if (out == nullptr) return false;
+    bool ok = fwrite(bytes.data(), 1, bytes.size(), out) == bytes.size();
+    return fclose(out) == 0 && ok;
+}
 
-        //Breakdown Current Instruction
+// A checkpoint as read by read_checkpoint. Cache states point into the file.
+struct Checkpoint {
+    uint64_t instructions = 0;
+    uint16_t pc = 0;
+    uint16_t regs[NUM_REGS] = {0};
+    vector<uint16_t> mem;
+    vector<array<int, 3>> levels; // size, associativity and blocksize of each cache level
+    vector<const unsigned char*> level_states; // for Cache::loadState
 
-        //Control parameters
-        uint16_t opCode = curr_ins >> 13;
-        uint16_t func = curr_ins & 15;
+    // The saved state of a cache level if it had this configuration, or nullptr
+    const unsigned char* stateFor(int level, const vector<int>& parts) const {
+        if (level >= (int)levels.size() || parts.size() < 3 * (size_t)level + 3) return nullptr;
+        for (int i = 0; i < 3; i++) {
+            if (levels[level][i] != parts[3 * level + i]) return nullptr;
+        }
+        return level_states[level];
+    }
+};
 
-        //Registers
-        uint16_t rA = (curr_ins >> 10) & 7;
-        uint16_t rB = (curr_ins >> 7) & 7;
-        uint16_t rC = (curr_ins >> 4) & 7;
+/*
+    Reads a checkpoint written by write_checkpoint.
 
-        //Immediate Values
-        uint16_t imm7 = curr_ins & 127;
-        if (imm7 & 64) imm7 |= 65408; // Sign extend 7 if its negative
-        uint16_t imm13 = curr_ins & 0x1FFF; // Zero extend imm13
-        uint16_t addr = (regs[rA] + imm7) & 8191;
+    @param error Set to what is wrong with the file, if anything
 
-        //Defaulted increment of Program counter
-        uint16_t new_pc = pc + 1;
+    @return false if file is not a well-formed checkpoint
+*/
+bool read_checkpoint(const MappedFile& file, Checkpoint& checkpoint, string& error) {
+    error = "Not a checkpoint";
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(file.data());
+    const unsigned char* end = p + file.size();
+    if (file.size() < CHECKPOINT_MACHINE_SIZE || !equal(CHECKPOINT_MAGIC, CHECKPOINT_MAGIC + sizeof(CHECKPOINT_MAGIC), file.data()))
+        return false;
+    p += sizeof(CHECKPOINT_MAGIC);
+    checkpoint.instructions = take_le(p, 8);
+    checkpoint.pc = take_le(p, 2);
+    for (size_t r = 0; r < NUM_REGS; r++) checkpoint.regs[r] = take_le(p, 2);
+    checkpoint.mem.resize(MEM_SIZE);
+    for (size_t addr = 0; addr < MEM_SIZE; addr++) checkpoint.mem[addr] = take_le(p, 2);
+    int count = take_le(p, 1);
+    if (count > 2) return false;
+    for (int level = 0; level < count; level++) {
+        if (end - p < 12) return false;
+        const unsigned char* state = p;
+        array<int, 3> config;
+        for (int i = 0; i < 3; i++) config[i] = take_le(p, 4);
+        if (!valid_cache_config(to_string(config[0]) + "," + to_string(config[1]) + "," + to_string(config[2])) ||
+            (size_t)(end - state) < Cache::stateSize(config[0], config[1], config[2]) ||
+            !Cache::validState(state, config[0], config[1], config[2]))
+            return false;
+        checkpoint.levels.push_back(config);
+        checkpoint.level_states.push_back(state);
+        p = state + Cache::stateSize(config[0], config[1], config[2]);
+    }
+    if (p != end) return false;
+    error.clear();
+    return true;
+}
+
+/*
+    Runs the loaded program with both cache levels absent, and returns
+    every memory access it makes, in order, as trace records.
+*/
+vector<uint32_t> capture_accesses(const string& core, uint16_t& pc, uint16_t regs[], uint16_t mem[],
+                                  DecodedIns decoded[]) {
+    TraceWriter capture;
+    Cache L1 = Cache("dummy", 0, 0, 0, nullptr);
+    Cache L2 = Cache("dummy", 0, 0, 0, nullptr);
+    L1.traceTo(&capture);
+    run_core(core, pc, regs, mem, decoded, L1, L2);
+    return capture.captured();
+}
+
+/*
+    LRU stack distances of the loads in an access stream, for caches with a
+    fixed number of rows and block size. A load at distance d hits in
+    every such cache with more than d ways and misses in all the others,
+    so one pass gives the L1 miss count of every associativity.
+
+    As in Cache::writeCache, a store always allocates a new copy of its
+    block. The old copy can never hit again but keeps its place in the
+    stack, so it still counts towards the distance of anything below it.
+*/
+struct StackDistances {
+    uint64_t loads = 0;
+    uint64_t stores = 0;
+    uint64_t cold = 0;           // loads of a block never accessed before
+    vector<uint64_t> histogram;  // loads by distance
+
+    uint64_t misses(size_t assoc) const {
+        uint64_t total = cold;
+        for (size_t d = assoc; d < histogram.size(); d++) total += histogram[d];
+        return total;
+    }
+};
 
-        if (opCode == 0b000) {
-            // Three reg instructions (add, sub, or, and, slt, jr)
-            if (func == 0b0000) regs[rC] = regs[rA] + regs[rB]; // add
+/*
+    Computes stack distances with one Fenwick tree per row over the times
+    of the row's accesses. A time is marked while the copy of a block
+    accessed then is still in the stack, so a distance is the number of
+    marks since the block's previous access.
 
-            else if (func == 0b0001) regs[rC] = regs[rA] - regs[rB]; // sub
+    @param records The access stream, as captured by a TraceWriter
 
-            else if (func == 0b0010) regs[rC] = regs[rA] | regs[rB]; // or
+    @param rows The number of rows of the caches
 
-            else if (func == 0b0011) regs[rC] = regs[rA] & regs[rB]; // and
+    @param block_size The block size of the caches
+*/
+StackDistances stack_distances(const vector<uint32_t>& records, int rows, int block_size) {
+    StackDistances result;
 
-            else if (func == 0b0100) regs[rC] = (regs[rA] < regs[rB]) ? 1 : 0; //slt
+    // Each row's tree covers its own range of slots: its first access, then its second, ...
+    vector<size_t> first_slot(rows + 1, 0);
+    for (uint32_t rec : records) first_slot[trace_addr(rec) / block_size % rows + 1]++;
+    for (int r = 0; r < rows; r++) first_slot[r + 1] += first_slot[r];
+    vector<uint32_t> tree(records.size() + 1, 0);
+    vector<size_t> used(rows, 0);
+    // Fenwick operations on row r, with positions 1-based within the row
+    auto add = [&](int r, size_t pos, int delta) {
+        size_t n = first_slot[r + 1] - first_slot[r];
+        for (; pos <= n; pos += pos & (0 - pos)) tree[first_slot[r] + pos] += delta;
+    };
+    auto marks_up_to = [&](int r, size_t pos) {
+        uint64_t total = 0;
+        for (; pos > 0; pos -= pos & (0 - pos)) total += tree[first_slot[r] + pos];
+        return total;
+    };
 
-            else if (func == 0b1000) new_pc = regs[rA]; // jr
+    // Position of each block's current copy within its row, or 0 if never accessed
+    vector<size_t> last(MEM_SIZE, 0);
+    for (uint32_t rec : records) {
+        int block_id = trace_addr(rec) / block_size;
+        int r = block_id % rows;
+        size_t now = ++used[r];
 
+        if (trace_op(rec) == AccessOp::LW) {
+            result.loads++;
+            if (last[block_id] == 0) {
+                result.cold++;
+            } else {
+                uint64_t d = marks_up_to(r, now - 1) - marks_up_to(r, last[block_id]);
+                if (d >= result.histogram.size()) result.histogram.resize(d + 1, 0);
+                result.histogram[d]++;
+                add(r, last[block_id], -1);
+            }
         } else {
-            // Two reg instructions
-            if (opCode == 0b001) regs[rB] = regs[rA] + imm7;// addi
+            result.stores++;
+        }
+        add(r, now, 1);
+        last[block_id] = now;
+    }
+    return result;
+}
 
-            else if (opCode == 0b010) new_pc = imm13; //j
+/*
+    Prints the L1 miss-ratio curve over associativity, for caches with the
+    given rows and block size, one line per associativity from 1 to
+    Cache::MAX_ASSOC, then the misses no cache of that shape can avoid.
+*/
+void print_stack_distances(LogWriter& log, const StackDistances& sd, int rows, int block_size) {
+    log.text("Stack distances for rows ");
+    log.number(rows);
+    log.text(", blocksize ");
+    log.number(block_size);
+    log.text(": LW ");
+    log.number(sd.loads);
+    log.text(", SW ");
+    log.number(sd.stores);
+    log.put('\n');
+
+    for (int assoc = 1; assoc <= Cache::MAX_ASSOC + 1; assoc++) {
+        bool unbounded = assoc > Cache::MAX_ASSOC;
+        uint64_t misses = unbounded ? sd.cold : sd.misses(assoc);
+        char rate[32];
+        snprintf(rate, sizeof(rate), "%.2f%%", sd.loads == 0 ? 0.0 : 100.0 * misses / sd.loads);
+        if (unbounded) {
+            log.text("assoc  any size      any");
+        } else {
+            log.text("assoc ");
+            log.number(assoc, 4);
+            log.text(" size ");
+            log.number((long long)rows * assoc * block_size, 8);
+        }
+        log.text(" LW misses ");
+        log.number(misses, 10);
+        log.text(" miss rate ");
+        print_column(log, rate, 8, false);
+        log.put('\n');
+    }
+}
 
-            else if (opCode == 0b100) {// lw
 
-                string L1_status = L1.access("LW", addr, pc);
+/*
+    Simulates every power-of-two associativity up to Cache::MAX_ASSOC with
+    every power-of-two number of rows at once, for one block size, in a
+    single pass over an access stream, and prints the L1 counters of each
+    (rows, associativity) pair. Rows go up to the point where a single way
+    covers all of memory.
 
-                if (L1_status == "MISS" && L2.getName() == "L2") L2.access("LW", addr, pc);
+    @param records The access stream, as captured by a TraceWriter
+*/
+void print_all_associativity(LogWriter& log, const vector<uint32_t>& records, int block_size) {
+    vector<int> row_counts;
+    for (int rows = 1; (size_t)rows * block_size <= MEM_SIZE; rows *= 2) row_counts.push_back(rows);
 
-                regs[rB] = mem[(regs[rA] + imm7) & 8191];
-            } else if (opCode == 0b101) {// sw
-                string L1_status = L1.access("SW", addr, pc);
+    vector<TruncatedLruStacks> stacks;
+    for (int rows : row_counts) stacks.emplace_back(rows, block_size);
+    for (uint32_t rec : records) {
+        for (TruncatedLruStacks& level : stacks) level.access(rec);
+    }
 
-                if (L1_status == "SW" && L2.getName() == "L2") L2.access("SW", addr, pc);
+    log.text("All associativities for blocksize ");
+    log.number(block_size);
+    log.put('\n');
+    for (size_t i = 0; i < row_counts.size(); i++) {
+        const TruncatedLruStacks& sd = stacks[i];
+        for (int assoc = 1; assoc <= Cache::MAX_ASSOC; assoc *= 2) {
+            uint64_t misses = sd.misses(assoc);
+            char rate[32];
+            snprintf(rate, sizeof(rate), "%.2f%%", sd.loads == 0 ? 0.0 : 100.0 * misses / sd.loads);
+            log.text("rows ");
+            log.number(row_counts[i], 4);
+            log.text(" assoc ");
+            log.number(assoc, 2);
+            log.text(" size ");
+            log.number((long long)row_counts[i] * assoc * block_size, 7);
+            log.text(" LW hits ");
+            log.number(sd.loads - misses, 10);
+            log.text(" LW misses ");
+            log.number(misses, 10);
+            log.text(" SW ");
+            log.number(sd.stores, 10);
+            log.text(" miss rate ");
+            print_column(log, rate, 8, false);
+            log.put('\n');
+        }
+    }
+}
 
-                mem[(regs[rA] + imm7) & 8191] = regs[rB];
-            } else if (opCode == 0b110) new_pc = regs[rA] == regs[rB] ? (pc + 1 + imm7) : pc + 1;// jeq
 
-            else if (opCode == 0b111) regs[rB] = regs[rA] < imm7;// slti
+/*
+    Runs tasks 0 to count - 1 on a pool of threads. The tasks are dealt
+    out to the threads' own queues up front; a thread whose queue is empty
+    takes from the back of another's, so a few long tasks don't hold up
+    the rest.
+*/
+void run_work_stealing(size_t count, unsigned threads, const function<void(size_t)>& task) {
+    struct Queue {
+        mutex lock;
+        deque<size_t> tasks;
+    };
+    threads = (unsigned)max<size_t>(1, min<size_t>(threads, count));
+    vector<Queue> queues(threads);
+    for (size_t i = 0; i < count; i++) queues[i % threads].tasks.push_back(i);
 
-            else if (opCode == 0b011) { // jal
-                regs[7] = pc + 1;
-                new_pc = imm13;
+    auto worker = [&](unsigned self) {
+        for (;;) {
+            // No tasks are added once started, so if every queue is empty the work is done
+            bool found = false;
+            size_t next = 0;
+            for (unsigned k = 0; !found && k < threads; k++) {
+                Queue& queue = queues[(self + k) % threads];
+                lock_guard<mutex> guard(queue.lock);
+                if (queue.tasks.empty()) continue;
+                if (k == 0) {
+                    next = queue.tasks.front();
+                    queue.tasks.pop_front();
+                } else {
+                    next = queue.tasks.back();
+                    queue.tasks.pop_back();
+                }
+                found = true;
             }
+            if (!found) return;
+            task(next);
         }
+    };
+    vector<thread> pool;
+    for (unsigned t = 1; t < threads; t++) pool.emplace_back(worker, t);
+    worker(0);
+    for (thread& t : pool) t.join();
+}
 
-        //Check for halt condition
-        halt = (pc & 8191) == new_pc;
+// One line of a --batch manifest
+struct BatchJob {
+    string program;
+    string cache_config;
+    string output; // empty to go to the combined stream on stdout
+};
 
-        // Update Program counter, if halt is false
-        if (!halt) pc = new_pc;
+/*
+    Reads a --batch manifest: one job per line, as a program, a --cache
+    string and optionally a file for the job's output, separated by
+    whitespace. Blank lines and lines starting with '#' are skipped.
 
-        // Reset Rg0
-        regs[0] = 0;
+    @param error Set to what is wrong with the manifest, if anything
+
+    @return false if the manifest can't be read or has a bad line
+*/
+bool read_batch_manifest(const char* path, vector<BatchJob>& jobs, string& error) {
+    ifstream f(path);
+    if (!f.is_open()) {
+        error = string("Can't open file ") + path;
+        return false;
     }
+    string line;
+    for (int number = 1; getline(f, line); number++) {
+        istringstream fields(line);
+        BatchJob job;
+        if (!(fields >> job.program) || job.program[0] == '#') continue;
+        string extra;
+        if (!(fields >> job.cache_config) || !valid_cache_config(job.cache_config) ||
+            (fields >> job.output && fields >> extra)) {
+            error = string(path) + ":" + to_string(number) + ": expected program, cache config and optional output";
+            return false;
+        }
+        jobs.push_back(job);
+    }
+    return true;
+}
+
+/*
+    Runs one batch job from start to finish, with its own machine state
+    and caches, printing what a single run would print.
+
+    @param out Where to print the job's output
+
+    @param error Set to what went wrong, if anything
+
+    @return false if the job's program can't be loaded
+*/
+bool run_batch_job(const BatchJob& job, const string& core, bool stats_only, FILE* out, string& error) {
+    uint16_t pc = 0;
+    uint16_t regs[NUM_REGS] = {0};
+    vector<uint16_t> mem(MEM_SIZE, 0);
+    vector<DecodedIns> decoded(MEM_SIZE);
+
+    MappedFile program;
+    if (!program.open(job.program.c_str())) {
+        error = "Can't open file " + job.program;
+        return false;
+    }
+    size_t words;
+    if (!load_program(program, mem.data(), words, error)) return false;
+    predecode(mem.data(), decoded.data());
+
+    LogWriter log(out);
+    vector<int> parts = split_cache_config(job.cache_config);
+    Cache L1 = Cache("L1", parts[0], parts[1], parts[2], &log);
+    Cache L2 = parts.size() == 6 ? Cache("L2", parts[3], parts[4], parts[5], &log) : Cache("dummy", 0, 0, 0, nullptr);
+    if (stats_only) {
+        L1.stopLogging();
+        L2.stopLogging();
+    }
+    run_core(core, pc, regs, mem.data(), decoded.data(), L1, L2);
+    if (stats_only) {
+        print_cache_stats(log, L1.getName(), L1.stats());
+        if (L2.present()) print_cache_stats(log, L2.getName(), L2.stats());
+    }
+    return true;
+}
+
+/*
+    Runs every job of a --batch manifest on a work-stealing pool. Jobs with
+    an output file write to it; the others are gathered into one stream on
+    stdout, in manifest order, each after a line naming the job.
+
+    @return false if any job failed
+*/
+bool run_batch(const vector<BatchJob>& jobs, const string& core, bool stats_only, unsigned threads) {
+    vector<string> combined(jobs.size());
+    vector<char> finished(jobs.size(), 0);
+    vector<string> errors(jobs.size());
+    mutex print_lock;
+    size_t next_to_print = 0;
+    bool ok = true;
+
+    run_work_stealing(jobs.size(), threads, [&](size_t i) {
+        const BatchJob& job = jobs[i];
+        FILE* out = job.output.empty() ? tmpfile() : fopen(job.output.c_str(), "w");
+        bool job_ok = false;
+        string error;
+        if (out == nullptr) {
+            error = "Can't open file " + (job.output.empty() ? string("for output") : job.output);
+        } else {
+            job_ok = run_batch_job(job, core, stats_only, out, error);
+            if (job.output.empty()) {
+                // Keep the output until every earlier job has been printed
+                fflush(out);
+                rewind(out);
+                char buffer[1 << 14];
+                size_t n;
+                while ((n = fread(buffer, 1, sizeof(buffer), out)) > 0) combined[i].append(buffer, n);
+            }
+            fclose(out);
+        }
+
+        lock_guard<mutex> guard(print_lock);
+        errors[i] = error;
+        finished[i] = 1;
+        if (!job_ok) ok = false;
+        for (; next_to_print < jobs.size() && finished[next_to_print]; next_to_print++) {
+            const BatchJob& done = jobs[next_to_print];
+            if (!errors[next_to_print].empty())
+                cerr << "Job " << next_to_print + 1 << " (" << done.program << "): " << errors[next_to_print] << endl;
+            if (!done.output.empty()) continue;
+            string header = "Job " + to_string(next_to_print + 1) + ": " + done.program + " --cache " + done.cache_config + "\n";
+            fwrite(header.data(), 1, header.size(), stdout);
+            fwrite(combined[next_to_print].data(), 1, combined[next_to_print].size(), stdout);
+            string().swap(combined[next_to_print]);
+        }
+    });
+    fflush(stdout);
+    return ok;
 }
 
 
@@ -248,6 +3669,7 @@ int main(int argc, char* argv[]) {
     uint16_t pc = 0;
     uint16_t regArr[NUM_REGS] = {0};
     uint16_t mem[MEM_SIZE] = {0};
+    DecodedIns decoded[MEM_SIZE];
 
     /*
         Parse the command-line arguments
@@ -256,6 +3678,25 @@ int main(int argc, char* argv[]) {
     bool do_help = false;
     bool arg_error = false;
     string cache_config;
+    string core = "loop";
+    bool async_log = false;
+    bool stats_only = false;
+    bool pipeline = false;
+    const char* trace_out = nullptr;
+    const char* replay = nullptr;
+    const char* write_image = nullptr;
+    const char* batch = nullptr;
+    const char* checkpoint_out = nullptr;
+    const char* restore = nullptr;
+    uint64_t stop_after = NO_LIMIT;
+    uint64_t skip = 0;
+    uint64_t period = 0, window = 0;
+    bool warm = false;
+    bool steady = false;
+    const char* sweep = nullptr;
+    const char* stack_distance = nullptr;
+    const char* all_assoc = nullptr;
+    unsigned jobs = max(1u, thread::hardware_concurrency());
     for (int i = 1; i < argc; i++) {
         string arg(argv[i]);
         if (arg.rfind("-", 0) == 0) {
@@ -267,6 +3708,67 @@ int main(int argc, char* argv[]) {
                     arg_error = true;
                 else
                     cache_config = argv[i];
+            } else if (arg == "--core") {
+                i++;
+                if (i >= argc)
+                    arg_error = true;
+                else {
+                    core = argv[i];
+                    if (core != "loop" && core != "threaded" && core != "block" && core != "jit")
+                        arg_error = true;
+                }
+            } else if (arg == "--async-log")
+                async_log = true;
+            else if (arg == "--stats")
+                stats_only = true;
+            else if (arg == "--pipeline")
+                pipeline = true;
+            else if (arg == "--warm")
+                warm = true;
+            else if (arg == "--steady-state")
+                steady = true;
+            else if (arg == "--trace-out" || arg == "--replay" || arg == "--sweep" || arg == "--stack-distance" ||
+                     arg == "--all-assoc" || arg == "--write-image" || arg == "--batch" || arg == "--checkpoint" ||
+                     arg == "--restore" || arg == "--stop-after" || arg == "--fast-forward" || arg == "--sample") {
+                i++;
+                if (i >= argc)
+                    arg_error = true;
+                else if (arg == "--trace-out")
+                    trace_out = argv[i];
+                else if (arg == "--replay")
+                    replay = argv[i];
+                else if (arg == "--write-image")
+                    write_image = argv[i];
+                else if (arg == "--batch")
+                    batch = argv[i];
+                else if (arg == "--checkpoint")
+                    checkpoint_out = argv[i];
+                else if (arg == "--restore")
+                    restore = argv[i];
+                else if (arg == "--sweep")
+                    sweep = argv[i];
+                else if (arg == "--stack-distance")
+                    stack_distance = argv[i];
+                else if (arg == "--all-assoc")
+                    all_assoc = argv[i];
+                else if (arg == "--sample") {
+                    char* end;
+                    period = strtoull(argv[i], &end, 10);
+                    if (*end == ',') window = strtoull(end + 1, &end, 10);
+                    if (*end != '\0' || argv[i][0] == '-' || window == 0 || window >= period || period == NO_LIMIT)
+                        arg_error = true;
+                } else {
+                    char* end;
+                    uint64_t& count = arg == "--stop-after" ? stop_after : skip;
+                    count = strtoull(argv[i], &end, 10);
+                    if (*end != '\0' || argv[i][0] == '-' || count == NO_LIMIT) arg_error = true;
+                }
+            } else if (arg == "--jobs") {
+                i++;
+                if (i >= argc || atoi(argv[i]) < 1)
+                    arg_error = true;
+                else
+                    jobs = atoi(argv[i]);
             } else
                 arg_error = true;
         } else {
@@ -276,61 +3778,345 @@ int main(int argc, char* argv[]) {
                 arg_error = true;
         }
     }
+    // A replay runs a trace instead of a program, and needs caches to send it to
+    int analyses = (sweep != nullptr) + (stack_distance != nullptr) + (all_assoc != nullptr);
+    bool analysis = analyses > 0;
+    if (replay != nullptr && (filename != nullptr || trace_out != nullptr || (cache_config.empty() && !analysis)))
+        arg_error = true;
+    // A sweep or analysis brings its own caches, and prints only counters
+    if (analysis && (!cache_config.empty() || trace_out != nullptr || async_log || stats_only || analyses > 1))
+        arg_error = true;
+    // A batch brings its own programs and caches
+    if (batch != nullptr && (filename != nullptr || !cache_config.empty() || replay != nullptr || analysis ||
+                             trace_out != nullptr || write_image != nullptr || async_log || pipeline))
+        arg_error = true;
+    // A checkpoint is taken where a limited run stops, and a restored run has its program in the checkpoint
+    if ((checkpoint_out != nullptr && stop_after == NO_LIMIT) ||
+        ((stop_after != NO_LIMIT || restore != nullptr) &&
+         (replay != nullptr || analysis || batch != nullptr || write_image != nullptr || pipeline)) ||
+        (restore != nullptr && filename != nullptr))
+        arg_error = true;
+    // Fast-forwarding and sampling run a program, and sampling prints only estimates
+    bool sampling = period > 0;
+    if (((skip > 0 || sampling) &&
+         (replay != nullptr || analysis || batch != nullptr || write_image != nullptr || pipeline)) ||
+        (sampling && (cache_config.empty() || trace_out != nullptr || async_log || stats_only ||
+                      stop_after != NO_LIMIT)) ||
+        (warm && skip == 0 && !sampling))
+        arg_error = true;
+    // Skipped loop iterations are only counted, so there is no log or trace of them
+    if (steady && (!stats_only || replay != nullptr || analysis || batch != nullptr || write_image != nullptr ||
+                   pipeline || sampling || stop_after != NO_LIMIT || trace_out != nullptr))
+        arg_error = true;
+    // Converting a program runs nothing
+    if (write_image != nullptr && (filename == nullptr || !cache_config.empty() || replay != nullptr || analysis ||
+                                   trace_out != nullptr))
+        arg_error = true;
+    // The pipeline writes the log from its own last stage, and needs a program and caches
+    if (pipeline && (cache_config.empty() || replay != nullptr || trace_out != nullptr || async_log))
+        arg_error = true;
+
     /* Display error message if appropriate */
-    if (arg_error || do_help || filename == nullptr) {
-        cerr << "usage " << argv[0] << " [-h] [--cache CACHE] filename" << endl << endl;
+    if (arg_error || do_help || (filename == nullptr && replay == nullptr && batch == nullptr && restore == nullptr)) {
+        cerr << "usage " << argv[0] << " [-h] [--cache CACHE] [--core CORE] [--async-log | --pipeline] [--stats]" << endl;
+        cerr << "       [--trace-out TRACE] filename" << endl;
+        cerr << "       " << argv[0] << " --cache CACHE [--async-log] [--stats] --replay TRACE" << endl;
+        cerr << "       " << argv[0] << " --sweep CACHES [--jobs N] [--core CORE] (filename | --replay TRACE)" << endl;
+        cerr << "       " << argv[0] << " --stack-distance ROWS,BLOCKSIZE [--core CORE] (filename | --replay TRACE)" << endl;
+        cerr << "       " << argv[0] << " --all-assoc BLOCKSIZES [--core CORE] (filename | --replay TRACE)" << endl;
+        cerr << "       " << argv[0] << " --write-image IMAGE filename" << endl;
+        cerr << "       " << argv[0] << " --batch MANIFEST [--jobs N] [--core CORE] [--stats]" << endl;
+        cerr << "       " << argv[0] << " [--cache CACHE] [--fast-forward N [--warm]] [--stop-after N [--checkpoint FILE]]" << endl;
+        cerr << "       (filename | --restore FILE)" << endl;
+        cerr << "       " << argv[0] << " --cache CACHE [--fast-forward N] --sample PERIOD,WINDOW [--warm]" << endl;
+        cerr << "       (filename | --restore FILE)" << endl;
+        cerr << "       " << argv[0] << " [--cache CACHE] [--fast-forward N [--warm]] --stats --steady-state" << endl;
+        cerr << "       (filename | --restore FILE)" << endl << endl;
         cerr << "Simulate E20 cache" << endl << endl;
         cerr << "positional arguments:" << endl;
-        cerr << "  filename    The file containing machine code, typically with .bin suffix" << endl << endl;
+        cerr << "  filename    The file containing machine code, typically with .bin suffix," << endl;
+        cerr << "              or a program image written by --write-image" << endl << endl;
         cerr << "optional arguments:" << endl;
         cerr << "  -h, --help  show this help message and exit" << endl;
         cerr << "  --cache CACHE  Cache configuration: size,associativity,blocksize (for one" << endl;
         cerr << "                 cache) or" << endl;
         cerr << "                 size,associativity,blocksize,size,associativity,blocksize" << endl;
-        cerr << "                 (for two caches)" << endl;
+        cerr << "                 (for two caches). Associativity is at most " << Cache::MAX_ASSOC << endl;
+        cerr << "  --core CORE    Execution core: loop (reference, default), threaded, or" << endl;
+        cerr << "                 block (cached basic-block translation), or jit (block, with" << endl;
+        cerr << "                 hot blocks compiled to native x86-64 code)" << endl;
+        cerr << "  --async-log    Format and write the cache log on a separate thread" << endl;
+        cerr << "  --stats        Don't log each access; print per-cache counters at halt" << endl;
+        cerr << "  --pipeline     Simulate L1 and L2 each on their own thread, fed by the" << endl;
+        cerr << "                 program's thread through queues" << endl;
+        cerr << "  --trace-out TRACE  Record every memory access into the binary file TRACE;" << endl;
+        cerr << "                 works with or without --cache" << endl;
+        cerr << "  --replay TRACE Run the accesses recorded in TRACE through the caches," << endl;
+        cerr << "                 instead of a program" << endl;
+        cerr << "  --sweep CACHES Run the program once, then every cache configuration in" << endl;
+        cerr << "                 CACHES in parallel, and print a table of counters. CACHES" << endl;
+        cerr << "                 is a list of configurations separated by ';' or spaces," << endl;
+        cerr << "                 or @file to read them from a file. A field may list" << endl;
+        cerr << "                 alternatives, as in 16/32/64,1/2,4, to sweep every" << endl;
+        cerr << "                 combination" << endl;
+        cerr << "  --jobs N       Threads used by --sweep, --replay and --batch (default: one" << endl;
+        cerr << "                 per CPU)" << endl;
+        cerr << "  --stack-distance ROWS,BLOCKSIZE  Print the L1 miss rate of every" << endl;
+        cerr << "                 associativity with that many rows and that blocksize," << endl;
+        cerr << "                 from one pass over the program's accesses" << endl;
+        cerr << "  --all-assoc BLOCKSIZES  For each blocksize, print the L1 counters of" << endl;
+        cerr << "                 every power-of-two row count and associativity, from one" << endl;
+        cerr << "                 pass per blocksize. BLOCKSIZES is a list such as 1/4/16," << endl;
+        cerr << "                 or \"all\" for 1/2/4/8/16/32/64" << endl;
+        cerr << "  --write-image IMAGE  Convert the machine code in filename to a binary" << endl;
+        cerr << "                 program image, which loads without parsing, and exit" << endl;
+        cerr << "  --batch MANIFEST  Run every job listed in MANIFEST, one per line as" << endl;
+        cerr << "                 \"filename CACHE [OUTPUT]\", on --jobs threads. Jobs without" << endl;
+        cerr << "                 an OUTPUT file are printed to stdout in order, each after" << endl;
+        cerr << "                 a line naming it" << endl;
+        cerr << "  --stop-after N Stop after running N instructions, if the program hasn't" << endl;
+        cerr << "                 halted by then. Uses the loop core" << endl;
+        cerr << "  --checkpoint FILE  Where --stop-after stops, save pc, registers, memory" << endl;
+        cerr << "                 and the contents of the caches into FILE" << endl;
+        cerr << "  --restore FILE Carry on from a checkpoint instead of starting a program." << endl;
+        cerr << "                 Without --cache, the checkpoint's caches carry on where" << endl;
+        cerr << "                 they were; with it, each level that is configured as in" << endl;
+        cerr << "                 the checkpoint starts from its saved contents, and any" << endl;
+        cerr << "                 other starts empty" << endl;
+        cerr << "  --fast-forward N  Run the first N instructions without simulating the" << endl;
+        cerr << "                 caches, then carry on as usual" << endl;
+        cerr << "  --sample PERIOD,WINDOW  Simulate the caches only for the last WINDOW" << endl;
+        cerr << "                 instructions of every PERIOD, and print each cache's" << endl;
+        cerr << "                 accesses and miss rate extrapolated from them, with 95%" << endl;
+        cerr << "                 confidence intervals, instead of the log" << endl;
+        cerr << "  --warm         While fast-forwarding, keep the caches' contents up to" << endl;
+        cerr << "                 date, without logging or counting the accesses" << endl;
+        cerr << "  --steady-state With --stats, skip ahead through loops once their" << endl;
+        cerr << "                 registers step by constants and the caches repeat from" << endl;
+        cerr << "                 one period of iterations to the next. The counters come" << endl;
+        cerr << "                 out the same as without it. Uses the loop core" << endl;
         return 1;
     }
 
-    ifstream f(filename);
-    if (!f.is_open()) {
-        cerr << "Can't open file " << filename << endl;
-        return 1;
+    if (batch != nullptr) {
+        vector<BatchJob> jobs_list;
+        string error;
+        if (!read_batch_manifest(batch, jobs_list, error)) {
+            cerr << error << endl;
+            return 1;
+        }
+        return run_batch(jobs_list, core, stats_only, jobs) ? 0 : 1;
+    }
+
+    if (filename != nullptr) {
+        MappedFile program;
+        if (!program.open(filename)) {
+            cerr << "Can't open file " << filename << endl;
+            return 1;
+        }
+        size_t words;
+        string error;
+        if (!load_program(program, mem, words, error)) {
+            cerr << error << endl;
+            return 1;
+        }
+        if (write_image != nullptr) {
+            if (!write_program_image(write_image, mem, words)) {
+                cerr << "Can't write file " << write_image << endl;
+                return 1;
+            }
+            return 0;
+        }
+        predecode(mem, decoded);
+    }
+
+    MappedFile replay_trace_file;
+    if (replay != nullptr) {
+        if (!replay_trace_file.open(replay)) {
+            cerr << "Can't open file " << replay << endl;
+            return 1;
+        }
+        if (!is_trace(replay_trace_file)) {
+            cerr << "Not a memory-access trace: " << replay << endl;
+            return 1;
+        }
+    }
+
+    LogWriter log(stdout);
+
+    if (analysis) {
+        vector<string> configs;
+        string bad;
+        vector<int> shape;
+        if (sweep != nullptr && !expand_sweep(sweep, configs, bad)) {
+            cerr << "Invalid cache config " << bad << endl;
+            return 1;
+        }
+        if (stack_distance != nullptr) {
+            try {
+                shape = split_cache_config(stack_distance);
+            } catch (const exception&) {
+            }
+            if (shape.size() != 2 || shape[0] < 1 || shape[1] < 1) {
+                cerr << "Invalid rows and blocksize " << stack_distance << endl;
+                return 1;
+            }
+        }
+        vector<int> block_sizes;
+        if (all_assoc != nullptr) {
+            string list = all_assoc;
+            if (list == "all") list = "1/2/4/8/16/32/64";
+            replace(list.begin(), list.end(), '/', ',');
+            try {
+                block_sizes = split_cache_config(list);
+            } catch (const exception&) {
+                block_sizes.clear();
+            }
+            if (block_sizes.empty() ||
+                any_of(block_sizes.begin(), block_sizes.end(), [](int b) { return b < 1 || (size_t)b > MEM_SIZE; })) {
+                cerr << "Invalid blocksizes " << all_assoc << endl;
+                return 1;
+            }
+        }
+
+        vector<uint32_t> records = replay != nullptr ? trace_records(replay_trace_file) :
+                                                       capture_accesses(core, pc, regArr, mem, decoded);
+        if (sweep != nullptr)
+            run_sweep(records, configs, jobs, log);
+        else if (stack_distance != nullptr)
+            print_stack_distances(log, stack_distances(records, shape[0], shape[1]), shape[0], shape[1]);
+        else {
+            for (int block_size : block_sizes) print_all_associativity(log, records, block_size);
+        }
+        return 0;
+    }
+
+    MappedFile checkpoint_file;
+    Checkpoint restored;
+    if (restore != nullptr) {
+        string error;
+        if (!checkpoint_file.open(restore)) {
+            cerr << "Can't open file " << restore << endl;
+            return 1;
+        }
+        if (!read_checkpoint(checkpoint_file, restored, error)) {
+            cerr << error << ": " << restore << endl;
+            return 1;
+        }
+        pc = restored.pc;
+        copy(restored.regs, restored.regs + NUM_REGS, regArr);
+        copy(restored.mem.begin(), restored.mem.end(), mem);
+        predecode(mem, decoded);
     }
-    load_machine_code(f, mem);
 
+    // Without --cache, both levels stay dummies and only a trace is recorded
+    Cache L1 = Cache("dummy", 0, 0, 0, nullptr);
+    Cache L2 = Cache("dummy", 0, 0, 0, nullptr);
 
     if (cache_config.size() > 0) {
-        vector<int> parts;
-        size_t pos;
-        size_t lastpos = 0;
-        while ((pos = cache_config.find(",", lastpos)) != string::npos) {
-            parts.push_back(stoi(cache_config.substr(lastpos, pos)));
-            lastpos = pos + 1;
+        vector<int> parts = split_cache_config(cache_config);
+        if (parts.size() != 3 && parts.size() != 6) {
+            cerr << "Invalid cache config" << endl;
+            return 1;
         }
-        parts.push_back(stoi(cache_config.substr(lastpos)));
 
         // L1 parts
         int L1size = parts[0];
         int L1assoc = parts[1];
         int L1blocksize = parts[2];
 
-        // L2 parts
-        int L2size = parts[3];
-        int L2assoc = parts[4];
-        int L2blocksize = parts[5];
+        // L2 parts, if there is an L2
+        bool has_L2 = parts.size() == 6;
+        int L2size = has_L2 ? parts[3] : 0;
+        int L2assoc = has_L2 ? parts[4] : 0;
+        int L2blocksize = has_L2 ? parts[5] : 0;
 
-        Cache L1 = Cache("L1", L1size, L1assoc, L1blocksize);
-        Cache L2 = Cache("dummy", 0, 0, 0);
+        if (L1assoc < 1 || L1assoc > Cache::MAX_ASSOC || (has_L2 && (L2assoc < 1 || L2assoc > Cache::MAX_ASSOC))) {
+            cerr << "Invalid cache config: associativity must be 1 to " << Cache::MAX_ASSOC << endl;
+            return 1;
+        }
 
-        if (parts.size() == 3) {
-            sim(pc, regArr, mem, L1, L2);
-        } else if (parts.size() == 6) {
-            Cache L2 = Cache("L2", L2size, L2assoc, L2blocksize);
-            sim(pc, regArr, mem, L1, L2);
-        } else {
-            cerr << "Invalid cache config" << endl;
+        L1 = Cache("L1", L1size, L1assoc, L1blocksize, &log);
+        if (has_L2) L2 = Cache("L2", L2size, L2assoc, L2blocksize, &log);
+
+        const unsigned char* state;
+        if ((state = restored.stateFor(0, parts)) != nullptr) L1.loadState(state);
+        if ((state = restored.stateFor(1, parts)) != nullptr) L2.loadState(state);
+    } else if (!restored.levels.empty()) {
+        // Carry on with the checkpoint's caches, without printing their configuration again
+        for (size_t level = 0; level < restored.levels.size(); level++) {
+            const array<int, 3>& config = restored.levels[level];
+            Cache& cache = level == 0 ? L1 : L2;
+            cache = Cache(level == 0 ? "L1" : "L2", config[0], config[1], config[2], nullptr);
+            cache.logTo(&log);
+            const unsigned char* state = restored.level_states[level];
+            cache.loadState(state);
+        }
+    } else if (trace_out == nullptr && checkpoint_out == nullptr) {
+        return 0;
+    }
+
+    // Before anything is traced, and before the log is handed to another thread
+    uint64_t skipped = skip;
+    if (skip > 0) {
+        fast_forward(pc, regArr, mem, decoded, L1, L2, warm, &log, skipped);
+        skipped = skip - skipped;
+    }
+
+    FILE* trace_file = nullptr;
+    unique_ptr<TraceWriter> trace;
+    if (trace_out != nullptr) {
+        trace_file = fopen(trace_out, "wb");
+        if (trace_file == nullptr) {
+            cerr << "Can't open file " << trace_out << endl;
             return 1;
         }
+        trace.reset(new TraceWriter(trace_file));
+        L1.traceTo(trace.get());
+    }
+
+    // Started after the configuration lines are printed, and finished while the caches are alive
+    unique_ptr<AsyncLog> async;
+    if (stats_only) {
+        L1.stopLogging();
+        L2.stopLogging();
+    } else if (async_log) {
+        async.reset(new AsyncLog(log));
+        L1.logTo(async.get());
+        L2.logTo(async.get());
+    }
+
+    uint64_t budget = stop_after;
+    if (replay != nullptr && jobs > 1)
+        replay_trace_parallel(replay_trace_file, L1, L2, jobs, stats_only ? nullptr : &log, async.get());
+    else if (replay != nullptr)
+        replay_trace(replay_trace_file, L1, L2);
+    else if (pipeline) {
+        L1.stopLogging();
+        L2.stopLogging();
+        run_pipelined(core, pc, regArr, mem, decoded, L1, L2, stats_only ? nullptr : &log);
+    } else if (sampling)
+        run_sampled(pc, regArr, mem, decoded, L1, L2, period, window, warm, log);
+    else if (steady)
+        run_steady(pc, regArr, mem, decoded, L1, L2);
+    else
+        run_core(core, pc, regArr, mem, decoded, L1, L2, budget);
+    if (async) async->finish();
+
+    if (checkpoint_out != nullptr &&
+        !write_checkpoint(checkpoint_out, restored.instructions + skipped + (stop_after - budget), pc, regArr, mem, L1, L2)) {
+        cerr << "Can't write file " << checkpoint_out << endl;
+        return 1;
+    }
+
+    if (trace) {
+        trace.reset();
+        fclose(trace_file);
+    }
+
+    if (stats_only) {
+        if (L1.present()) print_cache_stats(log, L1.getName(), L1.stats());
+        if (L2.present()) print_cache_stats(log, L2.getName(), L2.stats());
     }
     return 0;
 }